@@ -0,0 +1,52 @@
+# PakEmbed.cmake -- Link PAK files into executables
+#
+# pak_embed(<target> <pak> <symbol>)
+#
+# Generates a source file defining `const unsigned char <symbol>[]` and `const size_t <symbol>_size`
+# with the contents of <pak>, plus a <symbol>.hpp declaring them, and adds both to <target>.
+# Open the data with paklib::pak_memory_archive::open(<symbol>, <symbol>_size).
+
+set(PAK_EMBED_SCRIPT "${CMAKE_CURRENT_LIST_FILE}")
+
+function(pak_embed target pak symbol)
+	get_filename_component(pak "${pak}" ABSOLUTE)
+	set(outdir "${CMAKE_CURRENT_BINARY_DIR}/pak_embed")
+	set(src "${outdir}/${symbol}.cpp")
+	set(hdr "${outdir}/${symbol}.hpp")
+
+	add_custom_command(
+		OUTPUT "${src}" "${hdr}"
+		COMMAND "${CMAKE_COMMAND}" -DPAK_EMBED_INPUT=${pak} -DPAK_EMBED_SYMBOL=${symbol}
+			-DPAK_EMBED_SOURCE=${src} -DPAK_EMBED_HEADER=${hdr} -P "${PAK_EMBED_SCRIPT}"
+		DEPENDS "${pak}" "${PAK_EMBED_SCRIPT}"
+		COMMENT "Embedding ${pak} as ${symbol}"
+		VERBATIM
+	)
+
+	target_sources(${target} PRIVATE "${src}" "${hdr}")
+	target_include_directories(${target} PRIVATE "${outdir}")
+endfunction()
+
+# Script mode: invoked by the custom command above to generate the files
+if(CMAKE_SCRIPT_MODE_FILE AND DEFINED PAK_EMBED_INPUT)
+	file(READ "${PAK_EMBED_INPUT}" data HEX)
+	string(LENGTH "${data}" len)
+	math(EXPR size "${len} / 2")
+	string(REGEX REPLACE "([0-9a-f][0-9a-f])" "0x\\1," data "${data}")
+
+	file(WRITE "${PAK_EMBED_SOURCE}"
+		"/* Generated by PakEmbed.cmake from ${PAK_EMBED_INPUT} */\n"
+		"#include <cstddef>\n\n"
+		"extern const unsigned char ${PAK_EMBED_SYMBOL}[];\n"
+		"extern const size_t ${PAK_EMBED_SYMBOL}_size;\n\n"
+		"alignas(64) const unsigned char ${PAK_EMBED_SYMBOL}[] = {${data}0};\n"
+		"const size_t ${PAK_EMBED_SYMBOL}_size = ${size};\n"
+	)
+	file(WRITE "${PAK_EMBED_HEADER}"
+		"/* Generated by PakEmbed.cmake from ${PAK_EMBED_INPUT} */\n"
+		"#pragma once\n\n"
+		"#include <cstddef>\n\n"
+		"extern const unsigned char ${PAK_EMBED_SYMBOL}[];\n"
+		"extern const size_t ${PAK_EMBED_SYMBOL}_size;\n"
+	)
+endif()
@@ -3,8 +3,1229 @@
  * author: Jeremy Lorelli <jeremy.lorelli.1337@gmail.com>
  */
 #include "pak.hpp"
+#include "task_scheduler.hpp"
+#include "pak_catalog.hpp"
+#include "pak_chunk_store.hpp"
+#include "pak_direct_io.hpp"
+#include "pak_search.hpp"
+#include "pak_appender.hpp"
 #include "argparse.hpp"
 
+#include <set>
+#include <atomic>
+#include <cinttypes>
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <fnmatch.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+
+/* Entries larger than this are split into chunks that idle workers can steal */
+static constexpr uint64_t CHUNK_SIZE = 8ull << 20;
+
+/* Catalog file used by --catalog and --find when no other is given */
+static constexpr const char* DEFAULT_CATALOG = ".pakcatalog";
+
+/* How long the tree must be quiet before -c --watch applies the changes it saw */
+static constexpr int WATCH_SETTLE_MS = 100;
+
+/* Size of the buffer each worker copies through */
+static constexpr size_t COPY_BUFFER_SIZE = 1 << 20;
+
+/**
+ * \brief Turn an entry name into a valid, unique C++ identifier
+ */
+static std::string make_identifier(std::string_view name, std::set<std::string>& used) {
+	/* C++20 keywords and alternative tokens, plus the names of the generated enum and its struct */
+	static const std::set<std::string> reserved = {
+		"alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break",
+		"case", "catch", "char", "char8_t", "char16_t", "char32_t", "class", "compl", "concept",
+		"const", "consteval", "constexpr", "constinit", "const_cast", "continue", "co_await",
+		"co_return", "co_yield", "decltype", "default", "delete", "do", "double", "dynamic_cast",
+		"else", "enum", "explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+		"if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+		"nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register",
+		"reinterpret_cast", "requires", "return", "short", "signed", "sizeof", "static",
+		"static_assert", "static_cast", "struct", "switch", "template", "this", "thread_local",
+		"throw", "true", "try", "typedef", "typeid", "typename", "union", "unsigned", "using",
+		"virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq",
+		"asset", "id",
+	};
+
+	std::string id;
+	for (char c : name)
+		id.push_back(isalnum(static_cast<unsigned char>(c)) ? c : '_');
+	if (id.empty() || isdigit(static_cast<unsigned char>(id[0])))
+		id.insert(0, "_");
+	if (reserved.count(id))
+		id.push_back('_');
+
+	auto base = id;
+	for (int n = 2; used.count(id); ++n)
+		id = base + "_" + std::to_string(n);
+	used.insert(id);
+	return id;
+}
+
+/**
+ * \brief Write a C++ header describing the archive's directory
+ * The header holds a constexpr copy of the directory and lookup index, an enum of asset IDs and
+ * a pak_manifest_t that can be passed to pak_archive::open() to skip directory processing.
+ */
+static bool emit_header(const paklib::pak_archive& archive, const std::string& out, const std::string& ns) {
+	FILE* fp = fopen(out.c_str(), "wb");
+	if (!fp)
+		return false;
+
+	fprintf(fp, "/* Generated by paktool --emit-header, do not edit */\n");
+	fprintf(fp, "#pragma once\n\n#include \"pak.hpp\"\n\n");
+	fprintf(fp, "namespace %s\n{\n", ns.c_str());
+
+	std::set<std::string> used;
+	fprintf(fp, "\tstruct asset {\n\t\tenum id : int {\n");
+	for (int i = 0; i < archive.file_count(); ++i)
+		fprintf(fp, "\t\t\t%s = %d,\n", make_identifier(archive.name(i), used).c_str(), i);
+	fprintf(fp, "\t\t};\n\t};\n\n");
+
+	fprintf(fp, "\tinline constexpr paklib::pak_file_t files[] = {\n");
+	for (int i = 0; i < archive.file_count(); ++i) {
+		auto& f = archive.files()[i];
+		auto name = archive.name(i);
+
+		/* Names that fill the whole field have no room for a terminator, so spell those out */
+		if (name.size() == paklib::MAX_PAK_NAME_LEN) {
+			fprintf(fp, "\t\t{ {");
+			for (char c : name)
+				fprintf(fp, " '\\x%02x',", static_cast<unsigned char>(c));
+			fprintf(fp, " }");
+		}
+		else {
+			fprintf(fp, "\t\t{ \"");
+			for (char c : name) {
+				if (c == '"' || c == '\\')
+					fprintf(fp, "\\%c", c);
+				else if (isprint(static_cast<unsigned char>(c)))
+					fputc(c, fp);
+				else
+					fprintf(fp, "\\%03o", static_cast<unsigned char>(c));
+			}
+			fprintf(fp, "\"");
+		}
+		fprintf(fp, ", 0x%X, %u },\n", f.offset, f.size);
+	}
+	fprintf(fp, "\t};\n\n");
+
+	fprintf(fp, "\tinline constexpr paklib::pak_index_slot_t index[] = {\n");
+	for (auto& slot : archive.index())
+		fprintf(fp, "\t\t{ 0x%08X, %d },\n", slot.hash, slot.file);
+	fprintf(fp, "\t};\n\n");
+
+	fprintf(fp, "\tinline constexpr paklib::pak_manifest_t manifest = {\n");
+	fprintf(fp, "\t\t%" PRIu64 "ull, files, %d, index, %zu\n",
+		archive.fingerprint(), archive.file_count(), archive.index().size());
+	fprintf(fp, "\t};\n}\n");
+
+	return fclose(fp) == 0;
+}
+
+/**
+ * \brief State shared by all chunks of one entry in schedule_entries()
+ */
+struct entry_job_t {
+	int index;
+	int fd = -1;
+	std::atomic<uint64_t> remaining {0};
+	std::atomic<bool> ok {true};
+};
+
+/**
+ * \brief Run an operation over every entry of the archive on the scheduler
+ * begin(job) runs once per entry, chunk(job, offset, len) once for each CHUNK_SIZE piece of
+ * the entry and end(job) after its last chunk. Chunks are tasks of their own, so a handful of
+ * huge entries gets spread over all workers instead of leaving the rest idle at the end.
+ */
+template<class Begin, class Chunk, class End>
+static void schedule_entries(paklib::task_scheduler& sched, const paklib::pak_fd_archive& archive,
+	Begin&& begin, Chunk&& chunk, End&& end) {
+	for (int i = 0; i < archive.file_count(); ++i) {
+		sched.submit([&sched, &archive, &begin, &chunk, &end, i] {
+			auto job = std::make_shared<entry_job_t>();
+			job->index = i;
+			if (!begin(*job)) {
+				job->ok = false;
+				end(*job);
+				return;
+			}
+
+			const uint64_t size = archive.files()[i].size;
+			const uint64_t chunks = size ? (size + CHUNK_SIZE - 1) / CHUNK_SIZE : 1;
+			job->remaining = chunks;
+			for (uint64_t c = 0; c < chunks; ++c) {
+				auto run = [&chunk, &end, job, c, size] {
+					uint64_t off = c * CHUNK_SIZE;
+					uint64_t len = size - off < CHUNK_SIZE ? size - off : CHUNK_SIZE;
+					if (len && !chunk(*job, off, len))
+						job->ok = false;
+					if (--job->remaining == 0)
+						end(*job);
+				};
+
+				/* Keep the last chunk for ourselves, the rest are up for stealing */
+				if (c + 1 == chunks)
+					run();
+				else
+					sched.submit(run);
+			}
+		});
+	}
+	sched.wait();
+}
+
+/**
+ * \brief Creates the output directories of an extraction once, and keeps them open
+ * Every directory any entry lives in is collected up front, then created a level at a time with
+ * each level's mkdirs running in parallel. Directories are held open with O_PATH descriptors, so
+ * entries are created with openat() relative to their directory instead of resolving the whole
+ * path again for every file.
+ */
+class extract_planner {
+public:
+	explicit extract_planner(const paklib::pak_fd_archive& archive) {
+		m_dirs.push_back({"", "", -1, 0});
+		std::unordered_map<std::string, int> known {{"", 0}};
+		std::unordered_set<std::string> outputs;
+		for (int i = 0; i < archive.file_count(); ++i) {
+			auto name = archive.name(i);
+
+			/* Empty and . components are dropped, .. would escape the output directory */
+			std::string dir, leaf;
+			bool valid = true;
+			for (size_t pos = 0; pos <= name.size();) {
+				auto end = std::min(name.find('/', pos), name.size());
+				auto part = name.substr(pos, end - pos);
+				pos = end + 1;
+				if (part.empty() || part == ".")
+					continue;
+				if (part == "..")
+					valid = false;
+				if (!leaf.empty())
+					dir += (dir.empty() ? "" : "/") + leaf;
+				leaf = part;
+			}
+
+			/* A trailing slash names a directory, not a file */
+			if (!leaf.empty() && name.back() == '/') {
+				dir += (dir.empty() ? "" : "/") + leaf;
+				leaf.clear();
+			}
+			if (!valid || leaf.empty()) {
+				m_entries.push_back({INVALID, std::move(leaf)});
+				continue;
+			}
+			/* Like lookups by name, the first entry for a path wins */
+			if (!outputs.insert(dir + "/" + leaf).second) {
+				m_entries.push_back({SHADOWED, std::move(leaf)});
+				continue;
+			}
+			m_entries.push_back({dir.empty() ? 0 : add_dir(dir, known), std::move(leaf)});
+		}
+	}
+
+	extract_planner(const extract_planner&) = delete;
+
+	~extract_planner() {
+		for (auto& d : m_dirs)
+			if (d.fd >= 0)
+				close(d.fd);
+	}
+
+	/**
+	 * \brief Create root and every directory below it on sched
+	 */
+	bool create(const std::string& root, paklib::task_scheduler& sched) {
+		std::error_code ec;
+		std::filesystem::create_directories(root, ec);
+		m_dirs[0].fd = open(root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+		if (m_dirs[0].fd < 0)
+			return false;
+
+		/* One descriptor per directory, so make sure there is room for them and the files */
+		struct rlimit rl;
+		int64_t limit = INT64_MAX;
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+			if (rl.rlim_cur < rl.rlim_max) {
+				rl.rlim_cur = rl.rlim_max;
+				setrlimit(RLIMIT_NOFILE, &rl);
+				getrlimit(RLIMIT_NOFILE, &rl);
+			}
+			if (rl.rlim_cur != RLIM_INFINITY)
+				limit = rl.rlim_cur - std::min<rlim_t>(rl.rlim_cur / 2, 256);
+		}
+
+		int max_depth = 0;
+		for (auto& d : m_dirs)
+			max_depth = std::max(max_depth, d.depth);
+
+		std::atomic<bool> ok {true};
+		for (int depth = 1; depth <= max_depth; ++depth) {
+			for (size_t i = 1; i < m_dirs.size(); ++i) {
+				if (m_dirs[i].depth != depth)
+					continue;
+				sched.submit([this, &ok, limit, i] {
+					auto& d = m_dirs[i];
+					auto [fd, name] = locate(d.parent, d.name.c_str());
+					if (mkdirat(fd, name, 0755) != 0 && errno != EEXIST) {
+						ok = false;
+						return;
+					}
+					/* Descriptors are handed out lowest first, so past the limit the files would run out.
+					 * Entries below a directory without one resolve from the closest ancestor that has one */
+					d.fd = openat(fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+					if (d.fd >= limit) {
+						close(d.fd);
+						d.fd = -1;
+					}
+				});
+			}
+			sched.wait();
+		}
+		return ok;
+	}
+
+	/**
+	 * \brief True if entry i goes to the same path as an earlier entry, and is not extracted
+	 */
+	inline bool shadowed(int i) const { return m_entries[i].dir == SHADOWED; }
+
+	/**
+	 * \brief Open entry i for writing
+	 * Fails with EINVAL for entries without a file name, that contain .. components or are shadowed.
+	 */
+	int open_entry(int i, int flags, bool direct) const {
+		if (m_entries[i].dir < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		auto [fd, name] = locate(m_entries[i].dir, m_entries[i].leaf.c_str());
+		return direct ? paklib::pak_open_direct(fd, name, flags) : openat(fd, name, flags | O_CLOEXEC, 0644);
+	}
+
+protected:
+	struct dir_t {
+		std::string path;	/* Relative to the root */
+		std::string name;
+		int parent;
+		int depth;
+		int fd = -1;
+	};
+
+	static constexpr int INVALID = -1;
+	static constexpr int SHADOWED = -2;
+
+	struct entry_t {
+		int dir;			/* INVALID or SHADOWED if the entry is not extracted */
+		std::string leaf;
+	};
+
+	/* Index of the directory at path, a relative path without empty, . or .. components */
+	int add_dir(std::string_view path, std::unordered_map<std::string, int>& known) {
+		if (auto it = known.find(std::string(path)); it != known.end())
+			return it->second;
+		auto slash = path.find_last_of('/');
+		int parent = slash == path.npos ? 0 : add_dir(path.substr(0, slash), known);
+		m_dirs.push_back({std::string(path), std::string(slash == path.npos ? path : path.substr(slash + 1)),
+			parent, m_dirs[parent].depth + 1});
+		known.emplace(std::string(path), int(m_dirs.size() - 1));
+		return m_dirs.size() - 1;
+	}
+
+	/* Descriptor and path relative to it of name inside dir, via the closest ancestor that is open */
+	std::pair<int, const char*> locate(int dir, const char* name) const {
+		if (m_dirs[dir].fd >= 0)
+			return {m_dirs[dir].fd, name};
+		int from = dir;
+		while (m_dirs[from].fd < 0)
+			from = m_dirs[from].parent;
+		thread_local std::string path;
+		path.assign(m_dirs[dir].path, from == 0 ? 0 : m_dirs[from].path.size() + 1);
+		path += '/';
+		path += name;
+		return {m_dirs[from].fd, path.c_str()};
+	}
+
+	std::vector<dir_t> m_dirs;
+	std::vector<entry_t> m_entries;
+};
+
+/**
+ * \brief Output of the query modes, gathered in a large buffer and written out in big pieces
+ * Integers are formatted by hand instead of going through printf. Without a descriptor nothing is
+ * written and the caller takes the text with str().
+ */
+class output_buffer {
+public:
+	explicit output_buffer(int fd = -1) : m_fd(fd) {
+		if (fd >= 0)
+			m_buf.reserve(FLUSH_SIZE + 4096);
+	}
+	output_buffer(const output_buffer&) = delete;
+	~output_buffer() { flush(); }
+
+	inline output_buffer& put(char c) {
+		m_buf.push_back(c);
+		return *this;
+	}
+
+	inline output_buffer& put(std::string_view s) {
+		m_buf.append(s);
+		if (m_buf.size() >= FLUSH_SIZE)
+			flush();
+		return *this;
+	}
+
+	output_buffer& put_uint(uint64_t v) {
+		char tmp[20];
+		char* p = tmp + sizeof(tmp);
+		do {
+			*--p = '0' + v % 10;
+			v /= 10;
+		} while (v);
+		m_buf.append(p, tmp + sizeof(tmp) - p);
+		return *this;
+	}
+
+	output_buffer& put_hex(uint64_t v) {
+		static constexpr char digits[] = "0123456789ABCDEF";
+		char tmp[16];
+		char* p = tmp + sizeof(tmp);
+		do {
+			*--p = digits[v & 0xF];
+			v >>= 4;
+		} while (v);
+		m_buf.append(p, tmp + sizeof(tmp) - p);
+		return *this;
+	}
+
+	/* As a JSON string, quotes included */
+	output_buffer& put_json(std::string_view s) {
+		static constexpr char hex[] = "0123456789abcdef";
+		m_buf.push_back('"');
+		for (size_t i = 0; i < s.size(); ++i) {
+			unsigned char c = s[i];
+			if (c == '"' || c == '\\') {
+				m_buf.push_back('\\');
+				m_buf.push_back(c);
+			}
+			else if (c < 0x20) {
+				char esc[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF]};
+				m_buf.append(esc, sizeof(esc));
+			}
+			else if (c < 0x80)
+				m_buf.push_back(c);
+			else if (size_t n = utf8_length(s.substr(i))) {
+				m_buf.append(s.data() + i, n);
+				i += n - 1;
+			}
+			else {
+				/* Names are arbitrary bytes, JSON text has to be UTF-8 */
+				m_buf.append("\\ufffd");
+			}
+		}
+		m_buf.push_back('"');
+		return *this;
+	}
+
+	/* As a TSV field, with tabs, newlines and backslashes escaped */
+	output_buffer& put_tsv(std::string_view s) {
+		for (char c : s) {
+			switch (c) {
+			case '\t': m_buf.append("\\t"); break;
+			case '\n': m_buf.append("\\n"); break;
+			case '\r': m_buf.append("\\r"); break;
+			case '\\': m_buf.append("\\\\"); break;
+			default: m_buf.push_back(c);
+			}
+		}
+		return *this;
+	}
+
+	bool flush() {
+		if (m_fd < 0)
+			return true;
+		bool ok = true;
+		for (size_t off = 0; off < m_buf.size();) {
+			ssize_t r = write(m_fd, m_buf.data() + off, m_buf.size() - off);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0) {
+				ok = false;
+				break;
+			}
+			off += r;
+		}
+		m_buf.clear();
+		return ok;
+	}
+
+	inline std::string take() { return std::move(m_buf); }
+
+protected:
+	static constexpr size_t FLUSH_SIZE = 1 << 20;
+
+	/**
+	 * \brief Length of the well-formed UTF-8 sequence at the start of s, or 0 if there is none
+	 * Overlong forms, surrogates and code points past U+10FFFF are not well-formed.
+	 */
+	static size_t utf8_length(std::string_view s) {
+		auto b = [&](size_t i) { return static_cast<unsigned char>(s[i]); };
+		const unsigned char c = b(0);
+		size_t n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+		if (c < 0xC2 || c > 0xF4 || s.size() < n)
+			return 0;
+		/* The second byte's range depends on the lead byte, the others are plain continuations */
+		unsigned char lo = 0x80, hi = 0xBF;
+		if (c == 0xE0) lo = 0xA0;
+		else if (c == 0xED) hi = 0x9F;
+		else if (c == 0xF0) lo = 0x90;
+		else if (c == 0xF4) hi = 0x8F;
+		if (b(1) < lo || b(1) > hi)
+			return 0;
+		for (size_t i = 2; i < n; ++i)
+			if ((b(i) & 0xC0) != 0x80)
+				return 0;
+		return n;
+	}
+
+	int m_fd;
+	std::string m_buf;
+};
+
+enum class list_format {
+	text,
+	json,	/* One object per line */
+	tsv,
+	null,	/* Nothing, to time the listing itself */
+};
+
+/**
+ * \brief Write -i and -l output for one archive
+ */
+static void list_archive(const paklib::pak_archive& archive, const std::string& path, list_format fmt,
+	bool info, bool list, bool details, output_buffer& out) {
+	switch (fmt) {
+	case list_format::text:
+		if (info)
+			out.put("ID PAK archive, ").put_uint(archive.file_count()).put(" files\n");
+		if (list) {
+			for (int i = 0; i < archive.file_count(); ++i) {
+				out.put(archive.name(i)).put('\n');
+				if (details) {
+					auto& f = archive.files()[i];
+					out.put("  size:   ").put_uint(f.size).put(" (").put_uint(f.size / 1024).put(" KiB)\n");
+					out.put("  offset: 0x").put_hex(f.offset).put('\n');
+				}
+			}
+		}
+		break;
+	case list_format::json:
+		if (info)
+			out.put("{\"archive\":").put_json(path).put(",\"files\":").put_uint(archive.file_count()).put("}\n");
+		if (list) {
+			for (int i = 0; i < archive.file_count(); ++i) {
+				auto& f = archive.files()[i];
+				out.put("{\"archive\":").put_json(path).put(",\"name\":").put_json(archive.name(i))
+					.put(",\"offset\":").put_uint(f.offset).put(",\"size\":").put_uint(f.size).put("}\n");
+			}
+		}
+		break;
+	case list_format::tsv:
+		if (info)
+			out.put_tsv(path).put('\t').put_uint(archive.file_count()).put('\n');
+		if (list) {
+			for (int i = 0; i < archive.file_count(); ++i) {
+				auto& f = archive.files()[i];
+				out.put_tsv(path).put('\t').put_tsv(archive.name(i)).put('\t')
+					.put_uint(f.offset).put('\t').put_uint(f.size).put('\n');
+			}
+		}
+		break;
+	case list_format::null:
+		break;
+	}
+}
+
+/**
+ * \brief Byte count in the largest unit that keeps it at least 1, e.g. "1.5 MiB"
+ */
+static std::string format_size(uint64_t bytes) {
+	static const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+	double v = bytes;
+	int u = 0;
+	while (v >= 1024 && u < 4) {
+		v /= 1024;
+		++u;
+	}
+	char buf[32];
+	snprintf(buf, sizeof(buf), u ? "%.1f %s" : "%.0f %s", v, units[u]);
+	return buf;
+}
+
+/**
+ * \brief Print a layout report of the archive for --analyze
+ * Everything except the gap and overlap scan is gathered in a single walk over the directory.
+ * That scan needs the entries in data order, so it sorts a compact copy of the ranges, unless
+ * the walk found them already in order.
+ */
+static void analyze_archive(const paklib::pak_archive& archive, const std::string& path, int top) {
+	constexpr uint64_t PAGE = 4096;
+	const int count = archive.file_count();
+	const uint64_t file_size = archive.source().size();
+	const auto& hdr = archive.header();
+
+	struct dir_total_t {
+		uint64_t bytes = 0;
+		uint64_t entries = 0;
+	};
+	struct range_t {
+		uint64_t offset;
+		uint64_t size;
+		int index;
+	};
+
+	uint64_t total = 0, in_order = 0, backward = 0, seek_distance = 0, beyond_eof = 0;
+	uint64_t aligned = 0, straddling = 0;
+	uint64_t hist_count[34] = {}, hist_bytes[34] = {};
+	std::unordered_map<std::string_view, dir_total_t> dirs;
+	std::vector<range_t> ranges;
+	ranges.reserve(count);
+
+	for (int i = 0; i < count; ++i) {
+		auto& f = archive.files()[i];
+		const uint64_t off = f.offset, size = f.size;
+		total += size;
+		ranges.push_back({off, size, i});
+
+		/* Bucket 0 holds empty entries, bucket k sizes in [2^(k-1), 2^k) */
+		int bucket = size ? 64 - __builtin_clzll(size) : 0;
+		hist_count[bucket]++;
+		hist_bytes[bucket] += size;
+
+		/* Every directory above the entry gets its bytes, like du */
+		auto name = archive.name(i);
+		dirs[""].bytes += size;
+		dirs[""].entries++;
+		for (auto slash = name.find('/'); slash != name.npos; slash = name.find('/', slash + 1)) {
+			auto& d = dirs[name.substr(0, slash)];
+			d.bytes += size;
+			d.entries++;
+		}
+
+		if (off + size > file_size)
+			beyond_eof++;
+		if (off % PAGE == 0)
+			aligned++;
+		/* Pages touched beyond the minimum the size needs */
+		if (size && ((off + size - 1) / PAGE - off / PAGE + 1) > (size + PAGE - 1) / PAGE)
+			straddling++;
+
+		/* How closely reading in directory order follows the data */
+		if (i > 0) {
+			auto& prev = archive.files()[i - 1];
+			const uint64_t prev_end = uint64_t(prev.offset) + prev.size;
+			if (off >= prev.offset)
+				in_order++;
+			else
+				backward++;
+			seek_distance += off > prev_end ? off - prev_end : prev_end - off;
+		}
+	}
+
+	/* Walk the ranges in data order for gaps and overlaps. The header and directory take part as
+	 * ranges of their own, with negative indices, so they are not counted as dead space */
+	ranges.push_back({0, sizeof(paklib::pak_header_t), -1});
+	ranges.push_back({hdr.offset, hdr.size, -2});
+	if (backward || hdr.offset != sizeof(paklib::pak_header_t))
+		std::sort(ranges.begin(), ranges.end(), [](auto& a, auto& b) { return a.offset < b.offset || (a.offset == b.offset && a.size < b.size); });
+	else
+		std::rotate(ranges.begin(), ranges.end() - 2, ranges.end());
+
+	uint64_t covered = 0, end = 0, gaps = 0, gap_bytes = 0, shared = 0, overlapping = 0, in_metadata = 0;
+	uint64_t largest_gap = 0, largest_gap_at = 0;
+	const range_t* prev = nullptr;		/* Range that reaches furthest so far */
+	for (auto& r : ranges) {
+		if (!r.size)
+			continue;
+		if (std::min(r.offset, file_size) > end) {
+			const uint64_t gap = std::min(r.offset, file_size) - end;
+			gaps++;
+			gap_bytes += gap;
+			if (gap > largest_gap) {
+				largest_gap = gap;
+				largest_gap_at = end;
+			}
+		}
+		else if (prev && r.offset < end) {
+			if (prev->index < 0 || r.index < 0)
+				in_metadata++;
+			else if (r.offset == prev->offset && r.size == prev->size)
+				shared++;
+			else
+				overlapping++;
+		}
+
+		const uint64_t r_end = std::min(r.offset + r.size, file_size);
+		if (r_end > end) {
+			covered += r_end - std::max(end, r.offset);
+			end = r_end;
+			prev = &r;
+		}
+	}
+	const uint64_t tail = file_size > end ? file_size - end : 0;
+
+	printf("%s: %d entries, %s in entries, archive is %s\n", path.c_str(), count, format_size(total).c_str(), format_size(file_size).c_str());
+	printf("  directory    %s at 0x%X\n", format_size(hdr.size).c_str(), hdr.offset);
+	printf("  covered      %s by the header, directory and entries\n", format_size(covered).c_str());
+	printf("  dead space   %s in %llu gaps", format_size(gap_bytes).c_str(), (unsigned long long)gaps);
+	if (gaps)
+		printf(", largest %s at 0x%llX", format_size(largest_gap).c_str(), (unsigned long long)largest_gap_at);
+	printf(", %s trailing\n", format_size(tail).c_str());
+	printf("  overlaps     %llu entries share another's exact range, %llu overlap others, %llu overlap the header or directory\n",
+		(unsigned long long)shared, (unsigned long long)overlapping, (unsigned long long)in_metadata);
+	if (beyond_eof)
+		printf("  truncated    %llu entries extend past the end of the archive\n", (unsigned long long)beyond_eof);
+	printf("  alignment    %llu entries start on a 4 KiB boundary, %llu touch a page more than their size needs\n",
+		(unsigned long long)aligned, (unsigned long long)straddling);
+	if (count > 1)
+		printf("  order        %llu of %d steps in directory order move forward (%.1f%%), %llu go back, %s seek distance\n",
+			(unsigned long long)in_order, count - 1, 100.0 * in_order / (count - 1), (unsigned long long)backward,
+			format_size(seek_distance).c_str());
+
+	printf("  sizes\n");
+	for (int b = 0; b < 34; ++b) {
+		if (!hist_count[b])
+			continue;
+		auto lo = b ? format_size(1ull << (b - 1)) : std::string("0 B");
+		printf("    %-12s %10llu entries %12s\n", (b ? ">= " + lo : lo).c_str(),
+			(unsigned long long)hist_count[b], format_size(hist_bytes[b]).c_str());
+	}
+
+	/* Only the top entries are ordered */
+	std::vector<int> largest(count);
+	for (int i = 0; i < count; ++i)
+		largest[i] = i;
+	const int n = std::min(top, count);
+	std::partial_sort(largest.begin(), largest.begin() + n, largest.end(),
+		[&](int a, int b) { return archive.files()[a].size > archive.files()[b].size; });
+	printf("  largest entries\n");
+	for (int i = 0; i < n; ++i) {
+		auto name = archive.name(largest[i]);
+		printf("    %12s  %.*s\n", format_size(archive.files()[largest[i]].size).c_str(), int(name.size()), name.data());
+	}
+
+	std::vector<std::pair<std::string_view, dir_total_t>> dir_list(dirs.begin(), dirs.end());
+	const size_t nd = std::min<size_t>(top, dir_list.size());
+	std::partial_sort(dir_list.begin(), dir_list.begin() + nd, dir_list.end(),
+		[](auto& a, auto& b) { return a.second.bytes > b.second.bytes || (a.second.bytes == b.second.bytes && a.first < b.first); });
+	printf("  largest directories\n");
+	for (size_t i = 0; i < nd; ++i) {
+		auto& [name, d] = dir_list[i];
+		printf("    %12s %10llu entries  %.*s/\n", format_size(d.bytes).c_str(), (unsigned long long)d.entries,
+			int(name.size()), name.data());
+	}
+}
+
+/**
+ * \brief Reads exactly len bytes, or fewer only at the end of the stream
+ */
+static size_t read_full(int fd, void* buf, size_t len) {
+	size_t done = 0;
+	while (done < len) {
+		ssize_t r = read(fd, static_cast<char*>(buf) + done, len - done);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			break;
+		done += r;
+	}
+	return done;
+}
+
+/**
+ * \brief Number field of a tar header: octal text, or big-endian binary when the top bit is set
+ */
+static uint64_t tar_number(const char* field, size_t len) {
+	uint64_t v = 0;
+	if (static_cast<unsigned char>(field[0]) & 0x80) {
+		v = static_cast<unsigned char>(field[0]) & 0x7F;
+		for (size_t i = 1; i < len; ++i)
+			v = (v << 8) | static_cast<unsigned char>(field[i]);
+		return v;
+	}
+	for (size_t i = 0; i < len && field[i]; ++i)
+		if (field[i] >= '0' && field[i] <= '7')
+			v = v * 8 + (field[i] - '0');
+	return v;
+}
+
+/**
+ * \brief Convert a tar stream into a PAK, copying entry data straight through as it is read
+ * Understands ustar, GNU long names and pax path records. Only regular files are kept.
+ * \returns Number of entries skipped, or -1 if the stream is malformed or the PAK could not be written
+ */
+static int convert_tar(int in, paklib::pak_stream_writer& out, bool verbose) {
+	static constexpr size_t BLOCK = 512;
+	/* Long names and pax headers are held in memory, anything this large is not one */
+	static constexpr uint64_t MAX_TAR_META_SIZE = 1 << 20;
+	std::vector<char> buf(COPY_BUFFER_SIZE);
+	char hdr[BLOCK];
+	std::string long_name, pax_path;
+	int skipped = 0;
+
+	/* Read len bytes of entry data plus its padding, handing the data to sink */
+	auto consume = [&](uint64_t len, auto&& sink) {
+		uint64_t padded = (len + BLOCK - 1) / BLOCK * BLOCK;
+		for (uint64_t done = 0; done < padded;) {
+			size_t n = std::min<uint64_t>(buf.size(), padded - done);
+			if (read_full(in, buf.data(), n) != n)
+				return false;
+			if (done < len && !sink(buf.data(), std::min<uint64_t>(n, len - done)))
+				return false;
+			done += n;
+		}
+		return true;
+	};
+
+	for (;;) {
+		if (read_full(in, hdr, BLOCK) != BLOCK)
+			return -1;
+		/* The archive ends with zero blocks */
+		if (std::all_of(hdr, hdr + BLOCK, [](char c) { return c == 0; }))
+			return skipped;
+
+		unsigned sum = 0;
+		for (size_t i = 0; i < BLOCK; ++i)
+			sum += (i >= 148 && i < 156) ? ' ' : static_cast<unsigned char>(hdr[i]);
+		if (sum != tar_number(hdr + 148, 8))
+			return -1;
+
+		const char type = hdr[156];
+		const uint64_t size = tar_number(hdr + 124, 12);
+
+		/* Headers that describe the next entry */
+		if (type == 'L' || type == 'x') {
+			if (size > MAX_TAR_META_SIZE)
+				return -1;
+			std::string data;
+			if (!consume(size, [&](const char* p, size_t n) { data.append(p, n); return true; }))
+				return -1;
+			if (type == 'L')
+				long_name = data.c_str();
+			else {
+				/* Records are "<length> <key>=<value>\n", where length counts the whole record */
+				for (size_t pos = 0; pos < data.size();) {
+					size_t space = pos, reclen = 0;
+					while (space < data.size() && data[space] >= '0' && data[space] <= '9' && reclen <= data.size())
+						reclen = reclen * 10 + (data[space++] - '0');
+					if (space == pos || space >= data.size() || data[space] != ' '
+						|| reclen > data.size() - pos || reclen < space - pos + 2 || data[pos + reclen - 1] != '\n')
+						return -1;
+					std::string_view rec(data.data() + space + 1, pos + reclen - space - 2);
+					if (rec.starts_with("path="))
+						pax_path = rec.substr(5);
+					pos += reclen;
+				}
+			}
+			continue;
+		}
+
+		std::string name;
+		if (!pax_path.empty())
+			name = pax_path;
+		else if (!long_name.empty())
+			name = long_name;
+		else {
+			name.assign(hdr, strnlen(hdr, 100));
+			if (!memcmp(hdr + 257, "ustar", 5) && hdr[345])
+				name = std::string(hdr + 345, strnlen(hdr + 345, 155)) + "/" + name;
+		}
+		pax_path.clear();
+		long_name.clear();
+		while (name.starts_with("./"))
+			name.erase(0, 2);
+		while (name.starts_with("/"))
+			name.erase(0, 1);
+
+		if (type != '0' && type != '\0' && type != '7') {
+			if (type != '5' && type != 'g') {
+				fprintf(stderr, "Skipping %s, not a regular file\n", name.c_str());
+				++skipped;
+			}
+			/* Links and devices have no data, but skip whatever the header says is there */
+			if (!consume(type == '1' || type == '2' ? 0 : size, [](const char*, size_t) { return true; }))
+				return -1;
+			continue;
+		}
+
+		if (name.size() > paklib::MAX_PAK_NAME_LEN) {
+			fprintf(stderr, "Skipping %s, name is longer than %d characters\n", name.c_str(), paklib::MAX_PAK_NAME_LEN);
+			++skipped;
+			if (!consume(size, [](const char*, size_t) { return true; }))
+				return -1;
+			continue;
+		}
+
+		if (!out.begin_entry(name) || !consume(size, [&](const char* p, size_t n) { return out.write(p, n); }))
+			return -1;
+		if (verbose)
+			printf("Added %s (%llu bytes)\n", name.c_str(), (unsigned long long)size);
+	}
+}
+
+/**
+ * \brief Build the archive out with build() and keep it in sync with the tree under dir, for
+ * -c --watch. Does not return
+ * The watches are in place before build() runs, so nothing written while it builds is missed.
+ * Changes are gathered until the tree has been quiet for WATCH_SETTLE_MS, then applied in one
+ * commit: changed files are appended and deleted ones dropped. The archive is rewritten when
+ * dead space passes compact_percent of its size.
+ */
+template<class Build>
+[[noreturn]] static void watch_tree(const std::string& dir, const std::string& out, int compact_percent, bool verbose,
+	Build&& build) {
+	constexpr uint32_t MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR;
+
+	const int in = inotify_init1(IN_CLOEXEC);
+	if (in < 0) {
+		perror("inotify_init1");
+		exit(1);
+	}
+
+	std::unordered_map<int, std::string> watches;	/* Descriptor to directory, relative to dir */
+	std::set<std::string> dirty;					/* Paths to re-check, relative to dir */
+
+	/* Watch a directory and everything below it. Files already inside are marked dirty, as they
+	 * may have been written before the watch was in place */
+	auto watch = [&](const std::string& rel, bool mark) {
+		auto root = std::filesystem::path(dir) / rel;
+		auto add = [&](const std::filesystem::path& p) {
+			int wd = inotify_add_watch(in, p.c_str(), MASK & ~IN_ONLYDIR);
+			if (wd >= 0)
+				watches[wd] = p.lexically_relative(dir).generic_string();
+		};
+		add(root);
+		/* The tree can change under the walk, so errors end it instead of throwing */
+		const auto opts = std::filesystem::directory_options::skip_permission_denied;
+		std::error_code walk_ec, stat_ec;
+		for (auto it = std::filesystem::recursive_directory_iterator(root, opts, walk_ec);
+			!walk_ec && it != std::filesystem::recursive_directory_iterator(); it.increment(walk_ec)) {
+			if (it->is_directory(stat_ec))
+				add(it->path());
+			else if (mark)
+				dirty.insert(it->path().lexically_relative(dir).generic_string());
+		}
+	};
+	watch("", false);
+
+	if (!build())
+		exit(1);
+
+	paklib::pak_appender pak;
+	if (!pak.open(out.c_str())) {
+		fprintf(stderr, "Unable to open archive %s\n", out.c_str());
+		exit(1);
+	}
+
+	std::error_code ec;
+	const auto self = std::filesystem::weakly_canonical(out, ec);
+
+	auto join = [](const std::string& parent, const char* name) {
+		return parent.empty() || parent == "." ? std::string(name) : parent + "/" + name;
+	};
+
+	printf("Watching %s, keeping '%s' in sync\n", dir.c_str(), out.c_str());
+	fflush(stdout);
+
+	alignas(inotify_event) char buf[64 * 1024];
+	for (;;) {
+		pollfd pfd {in, POLLIN, 0};
+		int ready = poll(&pfd, 1, dirty.empty() ? -1 : WATCH_SETTLE_MS);
+		if (ready < 0 && errno == EINTR)
+			continue;
+
+		if (ready > 0) {
+			ssize_t len = read(in, buf, sizeof(buf));
+			for (ssize_t off = 0; off < len;) {
+				auto* ev = reinterpret_cast<const inotify_event*>(buf + off);
+				off += sizeof(inotify_event) + ev->len;
+
+				if (ev->mask & IN_Q_OVERFLOW) {
+					/* Lost track, so check everything */
+					for (auto& f : pak.files())
+						dirty.insert(std::string(f.name, strnlen(f.name, paklib::MAX_PAK_NAME_LEN)));
+					watch("", true);
+					continue;
+				}
+				if (ev->mask & IN_IGNORED) {
+					watches.erase(ev->wd);
+					continue;
+				}
+				auto it = watches.find(ev->wd);
+				if (it == watches.end() || !ev->len)
+					continue;
+				auto rel = join(it->second, ev->name);
+
+				if (ev->mask & IN_ISDIR) {
+					if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+						watch(rel, true);
+					else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+						/* Everything that was below it is gone */
+						for (auto& f : pak.files()) {
+							std::string_view name(f.name, strnlen(f.name, paklib::MAX_PAK_NAME_LEN));
+							if (name.size() > rel.size() && name.starts_with(rel) && name[rel.size()] == '/')
+								dirty.insert(std::string(name));
+						}
+					}
+				}
+				else if (!(ev->mask & IN_CREATE))
+					dirty.insert(rel);
+			}
+			continue;
+		}
+
+		/* Quiet for a while, apply what changed */
+		auto start = std::chrono::steady_clock::now();
+		int changed = 0, removed = 0;
+		for (auto& rel : dirty) {
+			auto path = std::filesystem::path(dir) / rel;
+			if (std::filesystem::is_regular_file(path, ec)) {
+				if (std::filesystem::weakly_canonical(path, ec) == self)
+					continue;
+				if (rel.size() > paklib::MAX_PAK_NAME_LEN) {
+					fprintf(stderr, "Skipping %s, name is longer than %d characters\n", rel.c_str(), paklib::MAX_PAK_NAME_LEN);
+					continue;
+				}
+				if (!pak.put(rel, path.c_str())) {
+					fprintf(stderr, "Unable to add %s\n", path.c_str());
+					continue;
+				}
+				++changed;
+				if (verbose)
+					printf("Updated %s\n", rel.c_str());
+			}
+			else if (pak.remove(rel)) {
+				++removed;
+				if (verbose)
+					printf("Removed %s\n", rel.c_str());
+			}
+		}
+		dirty.clear();
+		if (!changed && !removed)
+			continue;
+
+		if (!pak.commit()) {
+			fprintf(stderr, "Failed to update archive '%s'\n", out.c_str());
+			exit(1);
+		}
+		bool compacted = false;
+		if (pak.dead_space() * 100 > pak.size() * uint64_t(compact_percent)) {
+			if (!pak.compact()) {
+				fprintf(stderr, "Failed to compact archive '%s'\n", out.c_str());
+				exit(1);
+			}
+			compacted = true;
+		}
+
+		auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		printf("Updated '%s': %d changed, %d removed in %.1f ms%s\n", out.c_str(), changed, removed, ms,
+			compacted ? ", compacted" : "");
+		fflush(stdout);
+	}
+}
+
+/**
+ * \brief Add the files of a list to the builder, for -c --files-from
+ * Records are separated by newlines, or NULs with null_separated, and read
+ * "disk path[<TAB>pak path[<TAB>order]]". Without a pak path the disk path is used, minus any
+ * leading ./ or /. Entries are laid out by ascending order, which defaults to 0, and in list
+ * order otherwise.
+ * \returns Number of files added, or -1 if the list could not be read or an entry was rejected
+ */
+static int add_file_list(paklib::pak_builder& builder, const std::string& list, bool null_separated, bool verbose) {
+	int in = list == "-" ? STDIN_FILENO : open(list.c_str(), O_RDONLY | O_CLOEXEC);
+	if (in < 0) {
+		fprintf(stderr, "Unable to open file list %s\n", list.c_str());
+		return -1;
+	}
+	std::string text;
+	std::vector<char> buf(COPY_BUFFER_SIZE);
+	for (size_t n; (n = read_full(in, buf.data(), buf.size())) > 0;)
+		text.append(buf.data(), n);
+	if (in != STDIN_FILENO)
+		close(in);
+
+	struct item_t {
+		std::string_view disk;
+		std::string_view pak;
+		long order;
+	};
+	std::vector<item_t> items;
+	std::unordered_set<std::string_view> names;
+	const char sep = null_separated ? '\0' : '\n';
+	for (size_t pos = 0; pos < text.size();) {
+		size_t end = text.find(sep, pos);
+		if (end == text.npos)
+			end = text.size();
+		std::string_view rec(text.data() + pos, end - pos);
+		pos = end + 1;
+		if (!null_separated && rec.ends_with('\r'))
+			rec.remove_suffix(1);
+		if (rec.empty())
+			continue;
+
+		item_t item {rec, {}, 0};
+		if (auto tab = rec.find('\t'); tab != rec.npos) {
+			item.disk = rec.substr(0, tab);
+			item.pak = rec.substr(tab + 1);
+			if (auto tab2 = item.pak.find('\t'); tab2 != item.pak.npos) {
+				std::string order(item.pak.substr(tab2 + 1));
+				char* endp = nullptr;
+				errno = 0;
+				item.order = strtol(order.c_str(), &endp, 10);
+				if (order.empty() || *endp || errno == ERANGE) {
+					fprintf(stderr, "Invalid order '%s' in file list record '%.*s'\n", order.c_str(), int(rec.size()), rec.data());
+					return -1;
+				}
+				item.pak = item.pak.substr(0, tab2);
+			}
+		}
+		if (item.pak.empty()) {
+			item.pak = item.disk;
+			while (item.pak.starts_with("./"))
+				item.pak.remove_prefix(2);
+			while (item.pak.starts_with("/"))
+				item.pak.remove_prefix(1);
+		}
+		/* Lookups and extraction only ever see the first of several entries with one name */
+		if (!names.insert(item.pak).second) {
+			fprintf(stderr, "Duplicate pak path '%.*s' in file list\n", int(item.pak.size()), item.pak.data());
+			return -1;
+		}
+		items.push_back(item);
+	}
+
+	std::stable_sort(items.begin(), items.end(), [](auto& a, auto& b) { return a.order < b.order; });
+	for (auto& item : items) {
+		std::string disk(item.disk), pak(item.pak);
+		if (!builder.add_file(disk, pak)) {
+			fprintf(stderr, "Unable to add %s as %s\n", disk.c_str(), pak.c_str());
+			return -1;
+		}
+		if (verbose)
+			printf("Added %s as %s\n", disk.c_str(), pak.c_str());
+	}
+	return items.size();
+}
+
+/**
+ * \brief Byte range of an archive
+ */
+struct range_t {
+	uint64_t offset;
+	uint64_t size;
+};
+
+/**
+ * \brief Sort ranges by offset and merge those that overlap or are at most gap bytes apart
+ */
+static std::vector<range_t> coalesce_ranges(std::vector<range_t> ranges, uint64_t gap = 0) {
+	std::sort(ranges.begin(), ranges.end(), [](auto& a, auto& b) { return a.offset < b.offset; });
+	std::vector<range_t> out;
+	for (auto& r : ranges) {
+		if (!r.size)
+			continue;
+		if (!out.empty() && r.offset <= out.back().offset + out.back().size + gap) {
+			auto end = std::max(out.back().offset + out.back().size, r.offset + r.size);
+			out.back().size = end - out.back().offset;
+		}
+		else
+			out.push_back(r);
+	}
+	return out;
+}
+
+/**
+ * \brief True if the name matches any of the globs, or there are no globs
+ * Globs are matched against the whole entry name, and * also matches /.
+ */
+static bool match_globs(std::string_view name, const std::vector<std::string>& globs) {
+	if (globs.empty())
+		return true;
+	std::string n(name);
+	for (auto& g : globs)
+		if (fnmatch(g.c_str(), n.c_str(), 0) == 0)
+			return true;
+	return false;
+}
+
+/**
+ * \brief Selection of entries by the --include and --exclude globs
+ */
+struct entry_filter {
+	std::vector<std::string> includes;
+	std::vector<std::string> excludes;
+
+	explicit entry_filter(const argparse::ArgumentParser& parser) {
+		if (parser.is_used("--include"))
+			includes = parser.get<std::vector<std::string>>("--include");
+		if (parser.is_used("--exclude"))
+			excludes = parser.get<std::vector<std::string>>("--exclude");
+	}
+
+	inline bool excluded(std::string_view name) const { return !excludes.empty() && match_globs(name, excludes); }
+	inline bool operator()(std::string_view name) const { return match_globs(name, includes) && !excluded(name); }
+};
+
+/**
+ * \brief Parse a byte count with an optional K, M or G suffix
+ */
+static bool parse_size(const std::string& str, uint64_t& out) {
+	char* end;
+	unsigned long long v = strtoull(str.c_str(), &end, 10);
+	if (end == str.c_str())
+		return false;
+	switch (toupper(*end)) {
+	case 'G': v <<= 10; [[fallthrough]];
+	case 'M': v <<= 10; [[fallthrough]];
+	case 'K': v <<= 10; ++end; break;
+	case 0: break;
+	default: return false;
+	}
+	out = v;
+	return *end == 0 || ((end[0] == 'B' || end[0] == 'b') && end[1] == 0);
+}
+
+/**
+ * \brief Bytes of the page-aligned ranges of a mapping that are in the page cache
+ */
+static uint64_t resident_bytes(const uint8_t* base, const std::vector<range_t>& ranges) {
+	const uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t resident = 0;
+	std::vector<unsigned char> vec;
+	for (auto& r : ranges) {
+		vec.resize((r.size + page - 1) / page);
+		if (mincore(const_cast<uint8_t*>(base) + r.offset, r.size, vec.data()) != 0)
+			continue;
+		for (auto v : vec)
+			if (v & 1)
+				resident += page;
+	}
+	return resident;
+}
+
 int main(int argc, char** argv) {
 	argparse::ArgumentParser parser("paktool");
 
@@ -16,9 +1237,28 @@ int main(int argc, char** argv) {
 		.help("Display additional details when listing contents of the archive")
 		.implicit_value(true)
 		.default_value(false);
+	parser.add_argument("--format")
+		.help("Output of -i and -l: text, json (an object per line), tsv (archive, name, offset, size) or null")
+		.default_value(std::string("text"));
 	parser.add_argument("-c", "--create")
 		.help("Create a PAK file with this name")
 		.nargs(1);
+	parser.add_argument("--files-from")
+		.help("With -c, pack the files listed in this file (- for stdin) instead of a directory. "
+			"One 'disk path[<TAB>pak path[<TAB>order]]' per line")
+		.nargs(1);
+	parser.add_argument("--null")
+		.help("Records of --files-from are separated by NULs instead of newlines")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("--watch")
+		.help("With -c, keep watching the directory and update the PAK file as files change")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("--compact-threshold")
+		.help("With --watch, rewrite the PAK file once dead space passes this percentage of its size")
+		.default_value(50)
+		.scan<'i', int>();
 	parser.add_argument("-x", "--extract")
 		.help("Extract PAK file to this directory")
 		.nargs(1);
@@ -26,6 +1266,72 @@ int main(int argc, char** argv) {
 		.help("Display basic info about this PAK file")
 		.default_value(false)
 		.implicit_value(true);
+	parser.add_argument("--verify")
+		.help("Read every entry of the PAK files and report entries that are truncated or unreadable")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("--direct")
+		.help("Use O_DIRECT for extraction and verification, leaving the page cache alone")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("-j", "--jobs")
+		.help("Number of worker threads for extraction, verification and querying many archives")
+		.default_value(static_cast<int>(std::max(1u, std::thread::hardware_concurrency())))
+		.scan<'i', int>();
+	parser.add_argument("--catalog")
+		.help("'build DIR': Build or update a catalog of the PAK files under DIR, written to -o or DIR/.pakcatalog")
+		.nargs(2);
+	parser.add_argument("--find")
+		.help("List the PAK files containing this entry, using the catalog passed as file or ./.pakcatalog")
+		.nargs(1);
+	parser.add_argument("--chunk-store")
+		.help("Deduplicating chunk store to add the PAK files to, or to list or --materialize archives from")
+		.nargs(1);
+	parser.add_argument("--materialize")
+		.help("Rebuild this archive from the --chunk-store, to -o or the current directory")
+		.nargs(1);
+	parser.add_argument("--name")
+		.help("With --chunk-store, store the PAK file under this name instead of its file name, e.g. game-v2.pak")
+		.nargs(1);
+	parser.add_argument("--warm")
+		.help("Load entries of the PAK file into the page cache. Selects all entries unless --profile or --include is used, minus any --exclude")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("--profile")
+		.help("With --warm, a file listing entry names to warm, one per line, hottest first")
+		.nargs(1);
+	parser.add_argument("--include")
+		.help("With --warm, --grep and --filter, only process entries matching this glob. May be repeated")
+		.append();
+	parser.add_argument("--exclude")
+		.help("With --warm, --grep and --filter, skip entries matching this glob, even if --include matches them. May be repeated")
+		.append();
+	parser.add_argument("--lock")
+		.help("With --warm, mlock up to this many bytes of the selected entries (e.g. 512M) and hold them until interrupted")
+		.nargs(1);
+	parser.add_argument("--grep")
+		.help("Print archive:entry:offset for every occurrence of this string in the entries of the PAK files")
+		.nargs(1);
+	parser.add_argument("--analyze")
+		.help("Report the layout of the PAK files: sizes, directories, dead space, overlaps, alignment and ordering")
+		.default_value(false)
+		.implicit_value(true);
+	parser.add_argument("--top")
+		.help("Number of largest entries and directories --analyze lists")
+		.default_value(10)
+		.scan<'i', int>();
+	parser.add_argument("--from-tar")
+		.help("Convert a tar stream (- for stdin) into the PAK file given with -o")
+		.nargs(1);
+	parser.add_argument("--filter")
+		.help("Copy the entries of this PAK file selected by --include and --exclude into the PAK file given with -o")
+		.nargs(1);
+	parser.add_argument("--emit-header")
+		.help("Generate a C++ header with a constexpr manifest of the PAK file's contents")
+		.nargs(1);
+	parser.add_argument("--namespace")
+		.help("Namespace of the header generated by --emit-header. Defaults to the archive's name")
+		.nargs(1);
 	parser.add_argument("-h", "--help")
 		.help("Display help text")
 		.default_value(false)
@@ -52,11 +1358,17 @@ int main(int argc, char** argv) {
 		usage(0);
 
 	const bool verbose = parser.get<bool>("-v");
+	const int jobs = parser.get<int>("-j");
+	if (jobs < 1) {
+		fprintf(stderr, "Invalid number of jobs '%d', must be at least 1\n", jobs);
+		exit(1);
+	}
+	const bool direct = parser.get<bool>("--direct");
 
 	/* Extract PAK file */
 	if (parser.is_used("-x")) {
 		auto apath = parser.get("-x");
-		auto odir = parser.get("-o");
+		auto odir = parser.is_used("-o") ? parser.get("-o") : std::string();
 		if (odir.empty()) {
 			odir = apath;
 			auto l = odir.find_last_of(".");
@@ -64,98 +1376,679 @@ int main(int argc, char** argv) {
 			odir.append("/");
 		}
 
-		paklib::pak_archive archive;
+		paklib::pak_fd_archive archive;
 		if (!archive.open(apath.c_str())) {
 			fprintf(stderr, "Unable to open archive %s\n", apath.c_str());
 			exit(1);
 		}
 
-		std::filesystem::create_directory(odir);
+		paklib::task_scheduler sched(jobs);
+
+		/* Directories first, so that workers only have to create files */
+		extract_planner plan(archive);
+		if (!plan.create(odir, sched)) {
+			fprintf(stderr, "Unable to create the directories under %s\n", odir.c_str());
+			exit(1);
+		}
+
+		/* Bulk reads go through a second, uncached descriptor */
+		int dfd = direct ? paklib::pak_open_direct(apath.c_str(), O_RDONLY) : -1;
+		if (direct && dfd < 0) {
+			fprintf(stderr, "Unable to open archive %s\n", apath.c_str());
+			exit(1);
+		}
+
+		auto& src = archive.source();
+		schedule_entries(sched, archive,
+			[&](entry_job_t& job) {
+				if (plan.shadowed(job.index))
+					return false;
+				job.fd = plan.open_entry(job.index, O_WRONLY | O_CREAT | O_TRUNC, direct);
+				/* Size the file up front so chunks can be written in any order */
+				return job.fd >= 0 && ftruncate(job.fd, archive.files()[job.index].size) == 0;
+			},
+			[&](entry_job_t& job, uint64_t off, uint64_t len) {
+				if (!direct)
+					return paklib::copy_fd_range(src.fd(), archive.files()[job.index].offset + off, len, job.fd, off);
+
+				/* Chunks start CHUNK_SIZE aligned in the output, only the archive side is unaligned */
+				thread_local paklib::pak_direct_reader reader;
+				paklib::pak_direct_writer writer(job.fd, off);
+				return reader.read(dfd, archive.files()[job.index].offset + off, len,
+					[&](const uint8_t* p, size_t n) { return writer.write(p, n); }) && writer.flush();
+			},
+			[&](entry_job_t& job) {
+				auto name = archive.name(job.index);
+				if (plan.shadowed(job.index)) {
+					if (verbose)
+						printf("Skipping %.*s, an earlier entry has the same path\n", int(name.size()), name.data());
+					return;
+				}
+				/* Direct writes pad the last block, cut it back off */
+				if (direct && job.ok && ftruncate(job.fd, archive.files()[job.index].size) != 0)
+					job.ok = false;
+				if (job.fd >= 0)
+					close(job.fd);
+				if (!job.ok)
+					printf("Unable to extract %.*s\n", int(name.size()), name.data());
+				else if (verbose)
+					printf("%.*s -> %s/%.*s\n", int(name.size()), name.data(), odir.c_str(), int(name.size()), name.data());
+			});
+
+		if (dfd >= 0)
+			close(dfd);
+		archive.close();
+	}
+	/* Check that every entry can be read */
+	else if (parser.is_used("--verify")) {
+		if (!parser.is_used("files")) {
+			fprintf(stderr, "No PAK files provided!\n");
+			exit(1);
+		}
 
-		for (auto [name, d] : archive) {
-			/* Compute directory */
-			auto dir = name;
-			bool isdir = false;
-			if (auto pos = dir.find_last_of("/"); pos != std::string::npos) {
-				isdir = true;
-				dir.erase(pos);
+		int failed = 0;
+		paklib::task_scheduler sched(jobs);
+		for (auto& arch : parser.get<std::vector<std::string>>("files")) {
+			paklib::pak_fd_archive archive;
+			if (!archive.open(arch.c_str())) {
+				fprintf(stderr, "Unable to open archive %s\n", arch.c_str());
+				++failed;
+				continue;
 			}
 
-			/* Ensure directory exists */
-			if (isdir) {
-				dir.insert(0, odir + "/");
-				std::filesystem::create_directories(dir);
+			int dfd = direct ? paklib::pak_open_direct(arch.c_str(), O_RDONLY) : -1;
+			if (direct && dfd < 0) {
+				fprintf(stderr, "Unable to open archive %s\n", arch.c_str());
+				++failed;
+				continue;
 			}
 
-			auto opath = odir + "/" + name;
-			if (archive.extract_file(name, opath))
-				if (verbose)
-					printf("%s -> %s\n", name.c_str(), opath.c_str());
-				else;
+			std::atomic<int> bad {0};
+			auto& src = archive.source();
+			schedule_entries(sched, archive,
+				[](entry_job_t&) { return true; },
+				[&](entry_job_t& job, uint64_t off, uint64_t len) {
+					off += archive.files()[job.index].offset;
+					if (direct) {
+						thread_local paklib::pak_direct_reader reader;
+						return reader.read(dfd, off, len, [](const uint8_t*, size_t) { return true; });
+					}
+
+					thread_local std::vector<char> buf(COPY_BUFFER_SIZE);
+					for (uint64_t end = off + len; off < end; off += buf.size()) {
+						size_t n = end - off < buf.size() ? end - off : buf.size();
+						if (!src.read(buf.data(), n, off))
+							return false;
+					}
+					return true;
+				},
+				[&](entry_job_t& job) {
+					if (job.ok)
+						return;
+					auto name = archive.name(job.index);
+					printf("%s: %.*s is truncated or unreadable\n", arch.c_str(), int(name.size()), name.data());
+					++bad;
+				});
+			if (dfd >= 0)
+				close(dfd);
+
+			if (bad)
+				++failed;
+			if (verbose || bad)
+				printf("%s: %d of %d files OK\n", arch.c_str(), archive.file_count() - bad, archive.file_count());
+		}
+
+		if (failed)
+			exit(1);
+	}
+	/* Build cross-archive catalog */
+	else if (parser.is_used("--catalog")) {
+		auto args = parser.get<std::vector<std::string>>("--catalog");
+		if (args[0] != "build") {
+			fprintf(stderr, "Unknown catalog command '%s'\n", args[0].c_str());
+			usage(1);
+		}
+
+		auto dir = args[1];
+		auto out = parser.is_used("-o") ? parser.get("-o") : (std::filesystem::path(dir) / DEFAULT_CATALOG).string();
+
+		paklib::task_scheduler sched(jobs);
+		paklib::pak_catalog::build_stats_t stats;
+		if (!paklib::pak_catalog::build(dir, out, sched, &stats)) {
+			fprintf(stderr, "Failed to build catalog '%s'\n", out.c_str());
+			exit(1);
+		}
+
+		printf("Wrote catalog '%s' with %d archives (%d unchanged, %d scanned, %d unreadable)\n",
+			out.c_str(), stats.archives, stats.reused, stats.scanned, stats.failed);
+	}
+	/* Look up entry in catalog */
+	else if (parser.is_used("--find")) {
+		auto name = parser.get("--find");
+		auto cat = parser.is_used("files") ? parser.get<std::vector<std::string>>("files")[0] : std::string(DEFAULT_CATALOG);
+
+		paklib::pak_catalog catalog;
+		if (!catalog.open(cat.c_str())) {
+			fprintf(stderr, "Unable to open catalog %s\n", cat.c_str());
+			exit(1);
+		}
+
+		auto matches = catalog.find(name);
+		for (auto& m : matches) {
+			if (parser.is_used("-d"))
+				printf("%s (entry %d)\n", m.archive.c_str(), m.entry);
 			else
-				printf("Unable to extract %s\n", name.c_str());
+				printf("%s\n", m.archive.c_str());
 		}
 
-		archive.close();
+		if (matches.empty())
+			exit(1);
 	}
-	/* Create new archive */
-	else if (parser.is_used("-c")) {
-		auto dir = parser.get<std::vector<std::string>>("files")[0];
-		auto out = parser.get("-c");
+	/* Chunk store operations */
+	else if (parser.is_used("--chunk-store")) {
+		auto dir = parser.get("--chunk-store");
 
-		paklib::pak_builder builder;
-		
-		int filecount = 0;
-		for (auto f : std::filesystem::recursive_directory_iterator(dir)) {
-			if (f.is_directory())
-				continue;
+		paklib::pak_chunk_store store;
+		if (!store.open(dir)) {
+			fprintf(stderr, "Unable to open chunk store %s\n", dir.c_str());
+			exit(1);
+		}
 
-			/* Compute relative path inside of the PAK based on the top-level directory */
-			auto pp = f.path().string();
-			if (auto pos = pp.find_first_of(dir); pos != std::string::npos)
-				pp.erase(pos, dir.size() + 1);
+		paklib::task_scheduler sched(jobs);
+		if (parser.is_used("--materialize")) {
+			auto name = parser.get("--materialize");
+			auto out = parser.is_used("-o") ? parser.get("-o") : name;
+			if (!store.materialize(name, out, sched)) {
+				fprintf(stderr, "Failed to materialize '%s' from %s\n", name.c_str(), dir.c_str());
+				exit(1);
+			}
 			if (verbose)
-				printf("Added %s as %s\n", f.path().string().c_str(), pp.c_str());
-			builder.add_file(f, pp);
-			++filecount;
+				printf("Materialized '%s' as '%s'\n", name.c_str(), out.c_str());
+		}
+		else if (parser.is_used("files")) {
+			auto files = parser.get<std::vector<std::string>>("files");
+			auto name = parser.is_used("--name") ? parser.get("--name") : std::string();
+			if (!name.empty() && files.size() != 1) {
+				fprintf(stderr, "--name can only be used when adding a single PAK file\n");
+				exit(1);
+			}
+
+			for (auto& arch : files) {
+				paklib::pak_chunk_store::stats_t stats;
+				auto result = store.add(arch, sched, &stats, name);
+				if (result == paklib::pak_chunk_store::add_result::conflict) {
+					fprintf(stderr, "A different archive is already stored as '%s', use --name to store %s under another name\n",
+						name.empty() ? std::filesystem::path(arch).filename().c_str() : name.c_str(), arch.c_str());
+					exit(1);
+				}
+				if (result == paklib::pak_chunk_store::add_result::error) {
+					fprintf(stderr, "Failed to add archive %s to the chunk store\n", arch.c_str());
+					exit(1);
+				}
+				printf("%s: %llu bytes in %llu chunks, %llu new chunks (%llu bytes)\n", arch.c_str(),
+					(unsigned long long)stats.bytes, (unsigned long long)stats.chunks,
+					(unsigned long long)stats.new_chunks, (unsigned long long)stats.new_bytes);
+			}
+		}
+		else {
+			for (auto& name : store.archives())
+				printf("%s\n", name.c_str());
+		}
+	}
+	/* Pull entries into the page cache */
+	else if (parser.is_used("--warm")) {
+		if (!parser.is_used("files")) {
+			fprintf(stderr, "No PAK files provided!\n");
+			exit(1);
+		}
+
+		auto arch = parser.get<std::vector<std::string>>("files")[0];
+		paklib::pak_mmap_archive archive;
+		if (!archive.open(arch.c_str())) {
+			fprintf(stderr, "Unable to open archive %s\n", arch.c_str());
+			exit(1);
+		}
+
+		uint64_t lock_budget = 0;
+		if (parser.is_used("--lock") && !parse_size(parser.get("--lock"), lock_budget)) {
+			fprintf(stderr, "Invalid size '%s'\n", parser.get("--lock").c_str());
+			exit(1);
+		}
+
+		/* Profile entries first, in profile order, then anything matching the globs */
+		std::vector<int> selected;
+		std::vector<bool> seen(archive.file_count());
+		const entry_filter filter(parser);
+		auto select = [&](int i) {
+			if (i >= 0 && !seen[i] && !filter.excluded(archive.name(i))) {
+				seen[i] = true;
+				selected.push_back(i);
+			}
+		};
+		if (parser.is_used("--profile")) {
+			auto profile = parser.get("--profile");
+			FILE* fp = fopen(profile.c_str(), "rb");
+			if (!fp) {
+				fprintf(stderr, "Unable to open profile %s\n", profile.c_str());
+				exit(1);
+			}
+			char line[512];
+			while (fgets(line, sizeof(line), fp)) {
+				line[strcspn(line, "\r\n")] = 0;
+				select(archive.find(line));
+			}
+			fclose(fp);
+		}
+		if (!parser.is_used("--profile") || !filter.includes.empty())
+			for (int i = 0; i < archive.file_count(); ++i)
+				if (filter(archive.name(i)))
+					select(i);
+
+		/* Page-aligned ranges of the selected entries, clamped to the file */
+		const uint64_t page = sysconf(_SC_PAGESIZE);
+		const uint64_t fsize = archive.source().size();
+		auto page_range = [&](int i) {
+			auto& f = archive.files()[i];
+			uint64_t start = f.offset & ~(page - 1);
+			uint64_t end = std::min<uint64_t>((uint64_t(f.offset) + f.size + page - 1) & ~(page - 1), (fsize + page - 1) & ~(page - 1));
+			return range_t{start, end > start ? end - start : 0};
+		};
+		std::vector<range_t> ranges;
+		for (int i : selected)
+			ranges.push_back(page_range(i));
+		ranges = coalesce_ranges(std::move(ranges));
+
+		uint64_t total = 0;
+		for (auto& r : ranges)
+			total += r.size;
+		const uint64_t before = resident_bytes(archive.source().data(), ranges);
+
+		/* Read everything in big pieces, spread over the workers */
+		{
+			paklib::task_scheduler sched(jobs);
+			auto& src = archive.source();
+			for (auto& r : ranges) {
+				for (uint64_t off = 0; off < r.size; off += CHUNK_SIZE) {
+					uint64_t start = r.offset + off;
+					uint64_t len = std::min(CHUNK_SIZE, std::min(r.size - off, fsize - std::min(fsize, start)));
+					sched.submit([&src, start, len] {
+						thread_local std::vector<char> buf(COPY_BUFFER_SIZE);
+						for (uint64_t p = 0; p < len; p += buf.size())
+							pread(src.fd(), buf.data(), std::min<uint64_t>(buf.size(), len - p), start + p);
+					});
+				}
+			}
 		}
+		const uint64_t after = resident_bytes(archive.source().data(), ranges);
+
+		printf("%s: %zu entries, %llu bytes in %zu ranges: %llu bytes already resident, %llu bytes newly loaded\n",
+			arch.c_str(), selected.size(), (unsigned long long)total, ranges.size(),
+			(unsigned long long)before, (unsigned long long)(after > before ? after - before : 0));
 
-		if (!builder.write(out)) {
-			fprintf(stderr, "Failed to save archive '%s'\n", out.c_str());
+		/* Pin the hottest entries, which only lasts as long as we do */
+		if (lock_budget) {
+			uint64_t locked = 0;
+			for (int i : selected) {
+				auto r = page_range(i);
+				if (locked + r.size > lock_budget)
+					continue;
+				if (mlock(archive.source().data() + r.offset, r.size) != 0) {
+					perror("mlock");
+					break;
+				}
+				locked += r.size;
+			}
+			printf("Locked %llu bytes, holding them until interrupted\n", (unsigned long long)locked);
+			fflush(stdout);
+			for (;;)
+				pause();
+		}
+	}
+	/* Search entry data */
+	else if (parser.is_used("--grep")) {
+		if (!parser.is_used("files")) {
+			fprintf(stderr, "No PAK files provided!\n");
 			exit(1);
 		}
+		auto pattern = parser.get("--grep");
+		if (pattern.empty()) {
+			fprintf(stderr, "Empty search pattern\n");
+			exit(2);
+		}
+
+		const paklib::pak_substring_search search(pattern);
+		const entry_filter filter(parser);
+		output_buffer out(STDOUT_FILENO);
+		paklib::task_scheduler sched(jobs);
+		bool found = false, failed = false;
+
+		for (auto& arch : parser.get<std::vector<std::string>>("files")) {
+			paklib::pak_mmap_archive archive;
+			if (!archive.open(arch.c_str())) {
+				out.flush();
+				fprintf(stderr, "Unable to open archive %s\n", arch.c_str());
+				failed = true;
+				continue;
+			}
+
+			/* Entries are searched in CHUNK_SIZE pieces that overlap by the pattern length, and
+			 * each piece only reports matches starting inside it, so none are lost or doubled */
+			struct piece_t {
+				int index;
+				uint64_t offset;
+				std::vector<uint64_t> matches;
+			};
+			std::vector<piece_t> pieces;
+			for (int i = 0; i < archive.file_count(); ++i) {
+				if (!filter(archive.name(i)))
+					continue;
+				const uint64_t size = archive.files()[i].size;
+				for (uint64_t off = 0; off < size; off += CHUNK_SIZE)
+					pieces.push_back({i, off, {}});
+			}
+
+			std::atomic<bool> truncated {false};
+			for (auto& piece : pieces) {
+				sched.submit([&] {
+					auto data = archive.view(piece.index);
+					if (data.size() != archive.files()[piece.index].size) {
+						truncated = true;
+						return;
+					}
+					auto* begin = data.data() + piece.offset;
+					auto* stop = begin + std::min<uint64_t>(CHUNK_SIZE, data.size() - piece.offset);
+					auto* end = std::min(stop + search.size() - 1, data.data() + data.size());
+					for (auto* p = begin; (p = search.find(p, end)) && p < stop; ++p)
+						piece.matches.push_back(p - data.data());
+				});
+			}
+			sched.wait();
+
+			for (auto& piece : pieces) {
+				for (auto off : piece.matches) {
+					out.put(arch).put(':').put(archive.name(piece.index)).put(':').put_uint(off).put('\n');
+					found = true;
+				}
+			}
+			if (truncated) {
+				out.flush();
+				fprintf(stderr, "%s: some entries are truncated and were not searched\n", arch.c_str());
+				failed = true;
+			}
+		}
+		out.flush();
 
-		printf("Wrote archive '%s' with %d files\n", out.c_str(), filecount);
+		/* Like grep: 0 if anything matched, 1 if nothing did, 2 on errors */
+		if (failed)
+			exit(2);
+		if (!found)
+			exit(1);
 	}
-	/* Detail querying */
-	else {
+	/* Layout report */
+	else if (parser.is_used("--analyze")) {
 		if (!parser.is_used("files")) {
 			fprintf(stderr, "No PAK files provided!\n");
 			exit(1);
 		}
 
-		auto archives = parser.get<std::vector<std::string>>("files");
-		for (auto& arch : archives) {
+		int failed = 0;
+		for (auto& arch : parser.get<std::vector<std::string>>("files")) {
 			paklib::pak_archive archive;
 			if (!archive.open(arch.c_str())) {
 				fprintf(stderr, "Unable to open archive %s\n", arch.c_str());
+				++failed;
+				continue;
+			}
+			analyze_archive(archive, arch, std::max(parser.get<int>("--top"), 0));
+		}
+		if (failed)
+			exit(1);
+	}
+	/* Convert tar stream */
+	else if (parser.is_used("--from-tar")) {
+		auto tar = parser.get("--from-tar");
+		if (!parser.is_used("-o")) {
+			fprintf(stderr, "No output PAK given, use -o\n");
+			exit(1);
+		}
+		auto out = parser.get("-o");
+
+		int in = tar == "-" ? STDIN_FILENO : open(tar.c_str(), O_RDONLY | O_CLOEXEC);
+		if (in < 0) {
+			fprintf(stderr, "Unable to open %s\n", tar.c_str());
+			exit(1);
+		}
+
+		paklib::pak_stream_writer writer;
+		if (!writer.open(out.c_str())) {
+			fprintf(stderr, "Unable to create archive '%s'\n", out.c_str());
+			exit(1);
+		}
+
+		int skipped = convert_tar(in, writer, verbose);
+		if (skipped < 0 || !writer.finish()) {
+			fprintf(stderr, "Failed to convert '%s' into '%s'\n", tar.c_str(), out.c_str());
+			remove(out.c_str());
+			exit(1);
+		}
+
+		printf("Wrote archive '%s' with %zu files", out.c_str(), writer.file_count());
+		if (skipped)
+			printf(", skipped %d", skipped);
+		printf("\n");
+	}
+	/* Copy a subset of an archive */
+	else if (parser.is_used("--filter")) {
+		auto in = parser.get("--filter");
+		if (!parser.is_used("-o")) {
+			fprintf(stderr, "No output PAK given, use -o\n");
+			exit(1);
+		}
+		auto out = parser.get("-o");
+
+		paklib::pak_fd_archive archive;
+		if (!archive.open(in.c_str())) {
+			fprintf(stderr, "Unable to open archive %s\n", in.c_str());
+			exit(1);
+		}
+
+		const entry_filter filter(parser);
+		std::vector<int> selected;
+		for (int i = 0; i < archive.file_count(); ++i) {
+			auto name = archive.name(i);
+			if (!filter(name))
+				continue;
+			if (uint64_t(archive.files()[i].offset) + archive.files()[i].size > archive.source().size()) {
+				fprintf(stderr, "Skipping %.*s, its data runs past the end of the archive\n", int(name.size()), name.data());
+				continue;
+			}
+			selected.push_back(i);
+		}
+
+		std::vector<paklib::pak_file_t> entries;
+		uint64_t bytes = 0;
+		for (int i : selected) {
+			entries.push_back(archive.files()[i]);
+			bytes += archive.files()[i].size;
+		}
+
+		size_t ranges = 0;
+		int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		bool ok = fd >= 0 && paklib::pak_copy_entries(archive.source().fd(), std::move(entries), fd, &ranges);
+		if (fd >= 0)
+			ok = (close(fd) == 0) && ok;
+		if (!ok) {
+			fprintf(stderr, "Failed to write archive '%s'\n", out.c_str());
+			remove(out.c_str());
+			exit(1);
+		}
+
+		if (verbose)
+			for (int i : selected)
+				printf("%.*s\n", int(archive.name(i).size()), archive.name(i).data());
+		printf("Wrote archive '%s' with %zu of %d files, %llu bytes of entry data copied in %zu ranges\n", out.c_str(),
+			selected.size(), archive.file_count(), (unsigned long long)bytes, ranges);
+	}
+	/* Generate manifest header */
+	else if (parser.is_used("--emit-header")) {
+		if (!parser.is_used("files")) {
+			fprintf(stderr, "No PAK files provided!\n");
+			exit(1);
+		}
+
+		auto arch = parser.get<std::vector<std::string>>("files")[0];
+		auto out = parser.get("--emit-header");
+
+		paklib::pak_archive archive;
+		if (!archive.open(arch.c_str())) {
+			fprintf(stderr, "Unable to open archive %s\n", arch.c_str());
+			exit(1);
+		}
+
+		std::set<std::string> used;
+		auto ns = parser.is_used("--namespace") ? parser.get("--namespace")
+			: make_identifier(std::filesystem::path(arch).stem().string(), used);
+		if (!emit_header(archive, out, ns)) {
+			fprintf(stderr, "Failed to write header '%s'\n", out.c_str());
+			exit(1);
+		}
+
+		if (verbose)
+			printf("Wrote manifest of %d files to '%s'\n", archive.file_count(), out.c_str());
+	}
+	/* Create new archive */
+	else if (parser.is_used("-c")) {
+		auto out = parser.get("-c");
+		paklib::pak_builder builder;
+
+		/* Explicit list of files, in layout order */
+		if (parser.is_used("--files-from")) {
+			if (parser.get<bool>("--watch")) {
+				fprintf(stderr, "--watch can not be used with --files-from, it watches a directory\n");
+				exit(1);
+			}
+			int filecount = add_file_list(builder, parser.get("--files-from"), parser.get<bool>("--null"), verbose);
+			if (filecount < 0)
+				exit(1);
+			if (!builder.write(out)) {
+				fprintf(stderr, "Failed to save archive '%s'\n", out.c_str());
 				exit(1);
 			}
+			printf("Wrote archive '%s' with %d files\n", out.c_str(), filecount);
+			return 0;
+		}
+
+		if (!parser.is_used("files")) {
+			fprintf(stderr, "No directory provided!\n");
+			exit(1);
+		}
+		auto dir = parser.get<std::vector<std::string>>("files")[0];
+
+		auto build = [&] {
+			int filecount = 0;
+			for (auto f : std::filesystem::recursive_directory_iterator(dir)) {
+				if (f.is_directory())
+					continue;
+
+				/* Compute relative path inside of the PAK based on the top-level directory.
+				 * --watch names entries the same way, so both have to agree */
+				auto pp = f.path().lexically_relative(dir).generic_string();
+				if (verbose)
+					printf("Added %s as %s\n", f.path().string().c_str(), pp.c_str());
+				builder.add_file(f, pp);
+				++filecount;
+			}
 
-			if (parser.is_used("-i")) {
-				printf("ID PAK archive, %d files\n", archive.file_count());
+			if (!builder.write(out)) {
+				fprintf(stderr, "Failed to save archive '%s'\n", out.c_str());
+				return false;
 			}
 
-			const bool details = parser.is_used("-d");
-			if (parser.is_used("-l")) {
-				for (auto [name, det] : archive) {
-					printf("%s\n", name.c_str());
-					if (details) {
-						printf("  size:   %d (%d KiB)\n", det.size, det.size / 1024);
-						printf("  offset: 0x%X\n", det.offset);
-					}
+			printf("Wrote archive '%s' with %d files\n", out.c_str(), filecount);
+			return true;
+		};
+
+		if (parser.get<bool>("--watch"))
+			watch_tree(dir, out, parser.get<int>("--compact-threshold"), verbose, build);
+		if (!build())
+			exit(1);
+	}
+	/* Detail querying */
+	else {
+		if (!parser.is_used("files")) {
+			fprintf(stderr, "No PAK files provided!\n");
+			exit(1);
+		}
+
+		auto format = parser.get("--format");
+		list_format fmt;
+		if (format == "text")
+			fmt = list_format::text;
+		else if (format == "json")
+			fmt = list_format::json;
+		else if (format == "tsv")
+			fmt = list_format::tsv;
+		else if (format == "null")
+			fmt = list_format::null;
+		else {
+			fprintf(stderr, "Unknown format '%s'\n", format.c_str());
+			exit(1);
+		}
+
+		/* Archives are opened and listed in parallel, each into its own buffer, and written out in order */
+		struct query_t {
+			std::string text;
+			bool failed = false;
+			bool done = false;
+		};
+
+		auto archives = parser.get<std::vector<std::string>>("files");
+		std::vector<query_t> queries(archives.size());
+		std::mutex lock;
+		std::condition_variable ready;
+		const bool info = parser.is_used("-i"), list = parser.is_used("-l"), details = parser.is_used("-d");
+
+		paklib::task_scheduler sched(jobs);
+		for (size_t i = 0; i < archives.size(); ++i) {
+			sched.submit([&, i] {
+				query_t q;
+				paklib::pak_archive archive;
+				if (archive.open(archives[i].c_str())) {
+					output_buffer buf;
+					list_archive(archive, archives[i], fmt, info, list, details, buf);
+					q.text = buf.take();
 				}
+				else
+					q.failed = true;
+				q.done = true;
+
+				std::lock_guard guard(lock);
+				queries[i] = std::move(q);
+				ready.notify_all();
+			});
+		}
+
+		output_buffer out(STDOUT_FILENO);
+		int failed = 0;
+		for (size_t i = 0; i < archives.size(); ++i) {
+			query_t q;
+			{
+				std::unique_lock guard(lock);
+				ready.wait(guard, [&] { return queries[i].done; });
+				q = std::move(queries[i]);
 			}
+			out.put(q.text);
+			if (q.failed) {
+				out.flush();
+				fprintf(stderr, "Unable to open archive %s\n", archives[i].c_str());
+				++failed;
+			}
+		}
+		out.flush();
+
+		if (failed) {
+			fprintf(stderr, "%d of %zu archives could not be opened\n", failed, archives.size());
+			exit(1);
 		}
 	}
 }
@@ -5,10 +5,14 @@
 #include <cstdio>
 #include <vector>
 #include <cstring>
-#include <unordered_map>
 #include <fstream>
 #include <filesystem>
 #include <string>
+#include <string_view>
+#include <span>
+#include <memory_resource>
+
+#include "pak_source.hpp"
 
 namespace paklib
 {
@@ -33,6 +37,140 @@ namespace paklib
 		uint32_t size;
 	};
 
+	/**
+	 * \brief FNV-1a hash of a PAK entry name
+	 * This is the hash used by pak_archive's lookup index, and it can be evaluated at compile time
+	 */
+	constexpr uint32_t pak_name_hash(std::string_view name) {
+		uint32_t h = 2166136261u;
+		for (char c : name) {
+			h ^= static_cast<uint8_t>(c);
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	/**
+	 * \brief Entry name with its hash precomputed at compile time
+	 * Construct from a string literal, or use the _pak suffix from paklib::literals
+	 */
+	struct pak_name_literal {
+		template<size_t N>
+		explicit consteval pak_name_literal(const char (&str)[N]) : name(str, N - 1), hash(pak_name_hash(name)) {
+			if (N - 1 > MAX_PAK_NAME_LEN)
+				throw "PAK entry names may not be longer than MAX_PAK_NAME_LEN";
+		}
+
+		consteval pak_name_literal(const char* str, size_t len) : name(str, len), hash(pak_name_hash(name)) {
+			if (len > MAX_PAK_NAME_LEN)
+				throw "PAK entry names may not be longer than MAX_PAK_NAME_LEN";
+		}
+
+		std::string_view name;
+		uint32_t hash;
+	};
+
+	namespace literals
+	{
+		consteval pak_name_literal operator""_pak(const char* str, size_t len) {
+			return pak_name_literal(str, len);
+		}
+	}
+
+	/**
+	 * \brief FNV-1a 64-bit hash, used to fingerprint a PAK's header and directory
+	 */
+	inline uint64_t pak_fingerprint(const void* data, size_t len, uint64_t h = 14695981039346656037ull) {
+		auto* p = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < len; ++i) {
+			h ^= p[i];
+			h *= 1099511628211ull;
+		}
+		return h;
+	}
+
+	/**
+	 * \brief Slot of pak_archive's open-addressed lookup index; file is -1 for empty slots
+	 */
+	struct pak_index_slot_t {
+		uint32_t hash;
+		int file;
+	};
+
+	/**
+	 * \brief Precomputed directory and lookup index of a known PAK file
+	 * These are generated by `paktool --emit-header`. When the fingerprint matches the archive
+	 * being opened, pak_archive uses these tables instead of building its own.
+	 */
+	struct pak_manifest_t {
+		uint64_t fingerprint;
+		const pak_file_t* files;
+		size_t file_count;
+		const pak_index_slot_t* index;
+		size_t index_size;
+	};
+
+	/**
+	 * \brief Size-classed pool that pak_buffer allocations come from by default
+	 * Freed buffers are kept around for later reads of similar size, with per-thread pools to
+	 * avoid lock contention. Blocks too large for the pool go straight to the default resource.
+	 */
+	inline std::pmr::memory_resource* pak_buffer_pool() {
+		static std::pmr::synchronized_pool_resource pool(std::pmr::pool_options{0, 4 << 20});
+		return &pool;
+	}
+
+	/**
+	 * \brief Owned buffer of entry data, allocated from a memory_resource
+	 * Unlike a vector the contents are left uninitialized before the read fills them in.
+	 */
+	class pak_buffer {
+	public:
+		pak_buffer() = default;
+		pak_buffer(size_t size, std::pmr::memory_resource* mr) : m_resource(mr), m_size(size) {
+			/* Zero-sized buffers still get storage, a null buffer means a failed read */
+			m_data = static_cast<uint8_t*>(mr->allocate(size ? size : 1));
+		}
+		pak_buffer(const pak_buffer&) = delete;
+		pak_buffer(pak_buffer&& o) noexcept
+			: m_resource(o.m_resource), m_data(std::exchange(o.m_data, nullptr)), m_size(std::exchange(o.m_size, 0)) {}
+		pak_buffer& operator=(pak_buffer&& o) noexcept {
+			std::swap(m_resource, o.m_resource);
+			std::swap(m_data, o.m_data);
+			std::swap(m_size, o.m_size);
+			return *this;
+		}
+		~pak_buffer() { reset(); }
+
+		void reset() {
+			if (m_data)
+				m_resource->deallocate(m_data, m_size ? m_size : 1);
+			m_data = nullptr;
+			m_size = 0;
+		}
+
+		inline explicit operator bool() const { return m_data != nullptr; }
+		inline uint8_t* data() { return m_data; }
+		inline const uint8_t* data() const { return m_data; }
+		inline size_t size() const { return m_size; }
+		inline std::span<const uint8_t> span() const { return std::span(m_data, m_size); }
+
+	protected:
+		std::pmr::memory_resource* m_resource = nullptr;
+		uint8_t* m_data = nullptr;
+		size_t m_size = 0;
+	};
+
+	/**
+	 * \brief Told about every entry read from an archive it is attached to with set_observer()
+	 * Reads of part of an entry only count when they start at the beginning of the entry.
+	 */
+	class pak_access_observer {
+	public:
+		virtual ~pak_access_observer() = default;
+		virtual void on_access(int index) = 0;
+	};
+
 	enum PakError {
 		NoError,
 		OpenFailed,
@@ -42,92 +180,270 @@ namespace paklib
 
 	/**
 	 * \brief Read-only view of a PAK file
+	 * Source is the pak_byte_source the archive reads through. Lookups are the same for every
+	 * source, and sources that are contiguous in memory use the directory in place and expose
+	 * entries as views, so reads compile down to pointer arithmetic.
 	 */
-	class pak_archive {
+	template<pak_byte_source Source>
+	class basic_pak_archive {
 	public:
-		pak_archive() = default;
-		pak_archive(const pak_archive&) = delete;
-		pak_archive(pak_archive&&) = delete;
+		using source_type = Source;
 
-		~pak_archive() {
-			if (m_file)
-				fclose(m_file);
-		}
+		using allocator_type = std::pmr::polymorphic_allocator<>;
+
+		basic_pak_archive() = default;
 
-		inline bool good() const { return m_file != nullptr && m_errno == PakError::NoError; }
+		/**
+		 * \brief Archive whose directory copy and lookup index are allocated from mr
+		 * Use this to keep an archive's memory in an arena, such as a monotonic_buffer_resource.
+		 */
+		explicit basic_pak_archive(std::pmr::memory_resource* mr) : m_files(mr), m_index(mr) {}
+
+		inline allocator_type get_allocator() const { return m_index.get_allocator(); }
+		basic_pak_archive(const basic_pak_archive&) = delete;
+		basic_pak_archive(basic_pak_archive&&) = delete;
+
+		inline bool good() const { return m_open && m_errno == PakError::NoError; }
 		inline PakError last_error() const { return m_errno; }
-		inline int file_count() const { return m_files.size(); }
+		inline int file_count() const { return m_dir.size(); }
+		inline const Source& source() const { return m_src; }
+		inline const pak_header_t& header() const { return m_header; }
+
+		/**
+		 * \brief Attach an observer, such as a pak_prefetcher, or detach it with nullptr
+		 */
+		inline void set_observer(pak_access_observer* observer) { m_observer = observer; }
+
+		/**
+		 * \brief Directory entries, in on-disk order
+		 */
+		inline std::span<const pak_file_t> files() const { return m_dir; }
+
+		/**
+		 * \brief Slots of the lookup index, as probed by find()
+		 */
+		inline std::span<const pak_index_slot_t> index() const { return m_lookup; }
+
+		/**
+		 * \brief True if the archive was opened with a manifest whose directory matched
+		 */
+		inline bool manifest_matched() const { return m_manifest && m_dir.data() == m_manifest->files; }
+
+		/**
+		 * \brief Fingerprint of the header and directory, as stored in generated manifests
+		 */
+		uint64_t fingerprint() const {
+			uint64_t h = pak_fingerprint(&m_header, sizeof(m_header));
+			return pak_fingerprint(m_dir.data(), m_dir.size_bytes(), h);
+		}
+
+		/**
+		 * \brief Name of the entry at the specified index
+		 */
+		inline std::string_view name(int index) const {
+			auto& f = m_dir[index];
+			return std::string_view(f.name, strnlen(f.name, MAX_PAK_NAME_LEN));
+		}
+
+		/**
+		 * \brief Look up an entry by name
+		 * \returns Index of the entry, or -1 if it does not exist
+		 */
+		int find(std::string_view pak_path) const {
+			if (pak_path.size() > MAX_PAK_NAME_LEN)
+				return -1;
+			return find(pak_path, pak_name_hash(pak_path));
+		}
+
+		/**
+		 * \brief Look up an entry by a name whose hash was computed at compile time
+		 */
+		int find(const pak_name_literal& pak_path) const {
+			return find(pak_path.name, pak_path.hash);
+		}
 
 		/**
 		 * \brief Open a PAK file off of disk from the specified path
 		 * Reads the header and file entries
 		 */
-		bool open(const char* path) {
+		bool open(const char* path) requires pak_path_source<Source> {
 			close();
-
-			m_errno = NoError;
-			m_file = fopen(path, "rb");
-			if (!m_file) {
+			Source src;
+			if (!src.open(path)) {
 				m_errno = OpenFailed;
 				return false;
 			}
-			
-			fseek(m_file, 0, SEEK_END);
-			m_fileSize = ftell(m_file);
-			fseek(m_file, 0, SEEK_SET);
+			return open(std::move(src));
+		}
 
-			if (m_fileSize < sizeof(pak_header_t)) {
-				m_errno = InvalidHeader;
-				fclose(m_file);
+		/**
+		 * \brief Open a PAK file that is already in memory, such as one embedded into the executable
+		 * The memory must outlive the archive.
+		 */
+		bool open(const void* data, size_t size) requires std::constructible_from<Source, const void*, size_t> {
+			return open(Source(data, size));
+		}
+
+		/**
+		 * \brief Open a PAK file from a source that is already open
+		 * The archive takes ownership of the source.
+		 */
+		bool open(Source src) {
+			if (!open_directory(std::move(src)))
 				return false;
-			}
+			build_index();
+			return true;
+		}
 
-			/* Read header */
-			pak_header_t hdr;
-			if (fread(&hdr, sizeof(hdr), 1, m_file) != 1 || 
-				!(hdr.id[0] == 'P' && hdr.id[1] == 'A' && hdr.id[2] == 'C' && hdr.id[3] == 'K')) {
-				m_errno = InvalidHeader;
-				fclose(m_file);
+		/**
+		 * \brief Open a PAK file stored as an entry of another archive, without extracting it
+		 * Reads go through a window over the parent's source, so the parent must stay open.
+		 */
+		template<pak_byte_source Parent>
+		bool open(const basic_pak_archive<Parent>& parent, int index) requires std::same_as<Source, subrange_source<Parent>> {
+			close();
+			if (index < 0 || index >= parent.file_count()) {
+				m_errno = OpenFailed;
 				return false;
 			}
+			return open(parent.entry_source(index));
+		}
 
-			fseek(m_file, hdr.offset, SEEK_SET);
-
-			/* Reserve space for this many files */
-			m_files.resize(hdr.size / sizeof(pak_file_t));
-
-			/* Read big block of files */
-			if (fread(&m_files.at(0), hdr.size, 1, m_file) != 1) {
-				m_errno = InvalidFileEntry;
-				fclose(m_file);
+		/**
+		 * \brief Open a PAK file using a manifest generated by `paktool --emit-header`
+		 * If the archive's directory is the one in the manifest, the manifest's directory and
+		 * index are used as-is and no index is built. Otherwise this behaves like open(path).
+		 */
+		bool open(const char* path, const pak_manifest_t& manifest) requires pak_path_source<Source> {
+			close();
+			Source src;
+			if (!src.open(path)) {
+				m_errno = OpenFailed;
 				return false;
 			}
+			return open(std::move(src), manifest);
+		}
 
-			/* Populate fast lookup list */
-			for (int i = 0; i < m_files.size(); ++i) {
-				char name[MAX_PAK_NAME_LEN+1] {};
-				std::memcpy(name, m_files[i].name, MAX_PAK_NAME_LEN);
-				m_lookupMap.insert({name, i});
+		bool open(Source src, const pak_manifest_t& manifest) {
+			if (!open_directory(std::move(src)))
+				return false;
+			m_manifest = &manifest;
+			/* The fingerprint is a quick reject, only identical directory bytes let the manifest stand in */
+			if (m_dir.size() == manifest.file_count && fingerprint() == manifest.fingerprint
+				&& std::memcmp(m_dir.data(), manifest.files, m_dir.size_bytes()) == 0) {
+				m_files.clear();
+				m_dir = std::span(manifest.files, manifest.file_count);
+				m_lookup = std::span(manifest.index, manifest.index_size);
+				return true;
 			}
+			build_index();
 			return true;
 		}
 
+		/**
+		 * \brief Map an asset ID from the manifest this archive was opened with to an entry index
+		 * IDs are used directly when the manifest matched, otherwise they are looked up by name.
+		 * \returns Index of the entry, or -1 if it does not exist
+		 */
+		int resolve(int asset_id) const {
+			if (!m_manifest || asset_id < 0 || size_t(asset_id) >= m_manifest->file_count)
+				return -1;
+			if (manifest_matched())
+				return asset_id;
+			auto& f = m_manifest->files[asset_id];
+			return find(std::string_view(f.name, strnlen(f.name, MAX_PAK_NAME_LEN)));
+		}
+
+		/**
+		 * \brief View of an entry's data, without copying
+		 * \returns The entry's bytes, or an empty span if the entry is out of bounds
+		 */
+		std::span<const uint8_t> view(int index) const requires pak_contiguous_source<Source> {
+			if (index < 0 || index >= m_dir.size())
+				return {};
+			auto& f = m_dir[index];
+			if (uint64_t(f.offset) + f.size > m_src.size())
+				return {};
+			notify(index);
+			return std::span(m_src.data() + f.offset, f.size);
+		}
+
+		/**
+		 * \brief Source covering just the data of an entry
+		 * Use this to open a nested archive in place, see pak_nested_archive.
+		 */
+		subrange_source<Source> entry_source(int index) const {
+			auto& f = m_dir[index];
+			return subrange_source<Source>(m_src, f.offset, f.size);
+		}
+
 		void close() {
-			if (m_file)
-				fclose(m_file);
-			m_file = nullptr;
+			m_src = Source();
+			m_open = false;
 			m_files.clear();
-			m_lookupMap.clear();
+			m_index.clear();
+			m_dir = {};
+			m_lookup = {};
+			m_manifest = nullptr;
 		}
 
 		bool read_file(const std::string& pak_path, void* outbuf, size_t size) {
-			if (auto it = m_lookupMap.find(pak_path); it != m_lookupMap.end()) {
-				size_t fz = m_files[it->second].size;
-				size_t toread = fz < size ? fz : size;
-				fseek(m_file, m_files[it->second].offset, SEEK_SET);
-				return fread(outbuf, size, 1, m_file) == 1;
-			}
-			return false;
+			return read_file(find(pak_path), outbuf, size);
+		}
+
+		/**
+		 * \brief Read an entry by index, such as one returned by find() or resolve()
+		 * Reads at most size bytes; entries shorter than the buffer only fill part of it.
+		 */
+		bool read_file(int index, void* outbuf, size_t size) {
+			if (index < 0 || index >= m_dir.size())
+				return false;
+			size_t fz = m_dir[index].size;
+			size_t toread = fz < size ? fz : size;
+			notify(index);
+			return m_src.read(outbuf, toread, m_dir[index].offset);
+		}
+
+		pak_buffer read_file(const std::string& pak_path, std::pmr::memory_resource* mr = pak_buffer_pool()) const {
+			return read_file(find(pak_path), mr);
+		}
+
+		/**
+		 * \brief Read a whole entry into a buffer allocated from mr
+		 * \returns The entry's data, or a null buffer if the entry does not exist or could not be read
+		 */
+		pak_buffer read_file(int index, std::pmr::memory_resource* mr = pak_buffer_pool()) const {
+			if (index < 0 || index >= m_dir.size())
+				return {};
+			auto& f = m_dir[index];
+			notify(index);
+			pak_buffer buf(f.size, mr);
+			if (!m_src.read(buf.data(), f.size, f.offset))
+				buf.reset();
+			return buf;
+		}
+
+		size_t read_range(const std::string& pak_path, uint64_t offset, void* outbuf, size_t len) const {
+			return read_range(find(pak_path), offset, outbuf, len);
+		}
+
+		/**
+		 * \brief Read part of an entry
+		 * \param offset Offset from the start of the entry
+		 * \returns Number of bytes read. This is less than len when the range runs past the end of
+		 *  the entry, and 0 if the offset is at or past the end or the read failed.
+		 */
+		size_t read_range(int index, uint64_t offset, void* outbuf, size_t len) const {
+			if (index < 0 || index >= m_dir.size())
+				return 0;
+			auto& f = m_dir[index];
+			if (offset >= f.size)
+				return 0;
+			if (len > f.size - offset)
+				len = f.size - offset;
+			if (offset == 0)
+				notify(index);
+			return m_src.read(outbuf, len, f.offset + offset) ? len : 0;
 		}
 
 		/**
@@ -136,20 +452,29 @@ namespace paklib
 		 * \param out Path on disk
 		 */
 		bool extract_file(const std::string& pak_path, const std::string& out) {
-			if (auto it = m_lookupMap.find(pak_path); it != m_lookupMap.end())
+			if (int i = find(pak_path); i >= 0)
 			{
 				auto* fp = fopen(out.c_str(), "wb");
 				if (!fp)
 					return false;
 
-				auto& f = m_files[it->second];
-				fseek(m_file, f.offset, SEEK_SET);
+				auto& f = m_dir[i];
+				if constexpr (pak_contiguous_source<Source>) {
+					auto v = view(i);
+					bool ok = (!v.empty() || !f.size) && fwrite(v.data(), 1, v.size(), fp) == v.size();
+					fclose(fp);
+					return ok;
+				}
+
+				notify(i);
+				uint64_t off = f.offset;
 				int64_t sz = f.size;
 
 				char buf[8192];
-				for(;sz > 0; sz -= sizeof(buf)) {
-					fread(buf, sizeof(buf) > sz ? sz : sizeof(buf), 1, m_file);
-					fwrite(buf, sizeof(buf) > sz ? sz : sizeof(buf), 1, fp);
+				for(;sz > 0; sz -= sizeof(buf), off += sizeof(buf)) {
+					size_t n = sizeof(buf) > sz ? sz : sizeof(buf);
+					m_src.read(buf, n, off);
+					fwrite(buf, n, 1, fp);
 				}
 
 				fclose(fp);
@@ -159,9 +484,9 @@ namespace paklib
 		}
 
 		bool stat(const std::string& pak_path, size_t& file_size, size_t& offset) {
-			if (auto it = m_lookupMap.find(pak_path); it != m_lookupMap.end()) {
-				file_size = m_files[it->second].size;
-				offset = m_files[it->second].offset;
+			if (int i = find(pak_path); i >= 0) {
+				file_size = m_dir[i].size;
+				offset = m_dir[i].offset;
 				return true;
 			}
 			return false;
@@ -169,7 +494,7 @@ namespace paklib
 
 		class iterator {
 			int m_file;
-			pak_archive* m_archive;
+			basic_pak_archive* m_archive;
 		public:
 			using iterator_category = std::forward_iterator_tag;
 			using difference_type = decltype(m_file);
@@ -177,11 +502,11 @@ namespace paklib
 			using pointer = std::string*;
 			using reference = std::string&;
 
-			iterator(int start, pak_archive* a) : m_file(start), m_archive(a) {};
+			iterator(int start, basic_pak_archive* a) : m_file(start), m_archive(a) {};
 
 			std::pair<std::string, pak_file_details_t> operator*() const {
 				char p[MAX_PAK_NAME_LEN+1]{};
-				auto f = m_archive->m_files[m_file];
+				auto f = m_archive->m_dir[m_file];
 				std::memcpy(p, f.name, MAX_PAK_NAME_LEN);
 				return std::make_pair<std::string, pak_file_details_t>(p, { f.offset,f.size });
 			}
@@ -194,17 +519,130 @@ namespace paklib
 		};
 
 		iterator begin() { return iterator(0, this); }
-		iterator end() { return iterator(m_files.size(), this); }
+		iterator end() { return iterator(m_dir.size(), this); }
 
 
 	protected:
-		FILE* m_file = nullptr;
-		size_t m_fileSize = 0;
-		std::vector<pak_file_t> m_files;
+		inline void notify(int index) const {
+			if (m_observer)
+				m_observer->on_access(index);
+		}
+
+		/**
+		 * \brief Take ownership of the source and read its header and directory, without building the index
+		 */
+		bool open_directory(Source src) {
+			close();
+			m_src = std::move(src);
+
+			m_errno = NoError;
+			if (m_src.size() < sizeof(pak_header_t)) {
+				m_errno = InvalidHeader;
+				close();
+				return false;
+			}
+
+			/* Read header */
+			pak_header_t& hdr = m_header;
+			if (!m_src.read(&hdr, sizeof(hdr), 0) || 
+				!(hdr.id[0] == 'P' && hdr.id[1] == 'A' && hdr.id[2] == 'C' && hdr.id[3] == 'K')) {
+				m_errno = InvalidHeader;
+				close();
+				return false;
+			}
+
+			const size_t count = hdr.size / sizeof(pak_file_t);
+			if (uint64_t(hdr.offset) + count * sizeof(pak_file_t) > m_src.size()) {
+				m_errno = InvalidFileEntry;
+				close();
+				return false;
+			}
+
+			/* Contiguous sources already have the directory in memory, so use it in place */
+			if constexpr (pak_contiguous_source<Source>) {
+				m_dir = std::span(reinterpret_cast<const pak_file_t*>(m_src.data() + hdr.offset), count);
+			}
+			else {
+				/* Read big block of files */
+				m_files.resize(count);
+				if (!m_src.read(m_files.data(), count * sizeof(pak_file_t), hdr.offset)) {
+					m_errno = InvalidFileEntry;
+					close();
+					return false;
+				}
+				m_dir = m_files;
+			}
+
+			m_open = true;
+			return true;
+		}
+
+		int find(std::string_view pak_path, uint32_t hash) const {
+			if (m_lookup.empty())
+				return -1;
+			const size_t mask = m_lookup.size() - 1;
+			for (size_t s = hash & mask;; s = (s + 1) & mask) {
+				auto& slot = m_lookup[s];
+				if (slot.file < 0)
+					return -1;
+				if (slot.hash == hash && name(slot.file) == pak_path)
+					return slot.file;
+			}
+		}
+
+		/**
+		 * \brief Populate the lookup index from the directory in use
+		 * Capacity is kept at a power of two at most half full, so probes stay short.
+		 * Like before, the first entry wins if a name appears more than once.
+		 */
+		void build_index() {
+			size_t cap = 16;
+			while (cap < m_dir.size() * 2)
+				cap <<= 1;
+			m_index.assign(cap, pak_index_slot_t{0, -1});
+
+			const size_t mask = cap - 1;
+			for (int i = 0; i < m_dir.size(); ++i) {
+				auto n = name(i);
+				uint32_t h = pak_name_hash(n);
+				for (size_t s = h & mask;; s = (s + 1) & mask) {
+					auto& slot = m_index[s];
+					if (slot.file < 0) {
+						slot = {h, i};
+						break;
+					}
+					if (slot.hash == h && name(slot.file) == n)
+						break;
+				}
+			}
+			m_lookup = m_index;
+		}
+
+		Source m_src;
+		bool m_open = false;
+		pak_header_t m_header {};
+		std::pmr::vector<pak_file_t> m_files;
 		PakError m_errno = NoError;
-		std::unordered_map<std::string, int> m_lookupMap;
+		std::pmr::vector<pak_index_slot_t> m_index;
+
+		/* Directory and index in use; these point either at the vectors above or at a manifest */
+		std::span<const pak_file_t> m_dir;
+		std::span<const pak_index_slot_t> m_lookup;
+		const pak_manifest_t* m_manifest = nullptr;
+		pak_access_observer* m_observer = nullptr;
 	};
 
+	using pak_archive = basic_pak_archive<stdio_source>;
+	using pak_fd_archive = basic_pak_archive<fd_source>;
+	using pak_mmap_archive = basic_pak_archive<mmap_source>;
+	using pak_memory_archive = basic_pak_archive<memory_source>;
+
+	/**
+	 * \brief Archive stored inside an entry of an archive over Parent
+	 */
+	template<pak_byte_source Parent>
+	using pak_nested_archive = basic_pak_archive<subrange_source<Parent>>;
+
 	/**
 	 * \brief Simple PAK file builder
 	 * Use this to build a new pak file
@@ -215,8 +653,9 @@ namespace paklib
 		bool add_file(const std::filesystem::path& disk_path, const std::string& pak_path) {
 			if (pak_path.size() > MAX_PAK_NAME_LEN)
 				return false;
-			size_t sz;
-			if ((sz = std::filesystem::file_size(disk_path)) > UINT32_MAX)
+			std::error_code ec;
+			size_t sz = std::filesystem::file_size(disk_path, ec);
+			if (ec || sz > UINT32_MAX)
 				return false;
 			m_files.push_back({});
 			auto& f = m_files.back();
@@ -286,4 +725,82 @@ namespace paklib
 
 		std::vector<file_t> m_files;
 	};
+
+	/**
+	 * \brief Writes an archive front to back as entries arrive, with the directory at the end
+	 * Entry data is appended as it comes in, so sources that can only be read once, like a pipe,
+	 * need no staging. The output is only seeked once, in finish(), to fill in the header.
+	 */
+	class pak_stream_writer {
+	public:
+		pak_stream_writer() = default;
+		pak_stream_writer(const pak_stream_writer&) = delete;
+		~pak_stream_writer() {
+			if (m_fp)
+				fclose(m_fp);
+		}
+
+		bool open(const char* file) {
+			m_fp = fopen(file, "wb");
+			if (!m_fp)
+				return false;
+			setvbuf(m_fp, nullptr, _IOFBF, 1 << 20);
+
+			/* Placeholder until finish() knows where the directory is */
+			pak_header_t hdr {};
+			std::memcpy(hdr.id, "PACK", sizeof(hdr.id));
+			m_offset = sizeof(hdr);
+			return fwrite(&hdr, sizeof(hdr), 1, m_fp) == 1;
+		}
+
+		/**
+		 * \brief Start a new entry, whose data is then passed to write()
+		 */
+		bool begin_entry(std::string_view pak_path) {
+			if (!m_fp || pak_path.empty() || pak_path.size() > MAX_PAK_NAME_LEN)
+				return false;
+			pak_file_t f {};
+			std::memcpy(f.name, pak_path.data(), pak_path.size());
+			f.offset = m_offset;
+			m_files.push_back(f);
+			return true;
+		}
+
+		bool write(const void* data, size_t len) {
+			if (!m_fp || m_files.empty() || m_offset + len > UINT32_MAX)
+				return false;
+			if (len && fwrite(data, 1, len, m_fp) != len)
+				return false;
+			m_offset += len;
+			m_files.back().size += len;
+			return true;
+		}
+
+		inline size_t file_count() const { return m_files.size(); }
+
+		/**
+		 * \brief Append the directory, fill in the header and close the file
+		 */
+		bool finish() {
+			if (!m_fp)
+				return false;
+			const uint64_t dir_size = m_files.size() * sizeof(pak_file_t);
+			pak_header_t hdr {};
+			std::memcpy(hdr.id, "PACK", sizeof(hdr.id));
+			hdr.offset = m_offset;
+			hdr.size = dir_size;
+			bool ok = m_offset + dir_size <= UINT32_MAX
+				&& fwrite(m_files.data(), sizeof(pak_file_t), m_files.size(), m_fp) == m_files.size()
+				&& fseek(m_fp, 0, SEEK_SET) == 0
+				&& fwrite(&hdr, sizeof(hdr), 1, m_fp) == 1;
+			ok = (fclose(m_fp) == 0) && ok;
+			m_fp = nullptr;
+			return ok;
+		}
+
+	protected:
+		FILE* m_fp = nullptr;
+		uint64_t m_offset = 0;
+		std::vector<pak_file_t> m_files;
+	};
 }
\ No newline at end of file
@@ -0,0 +1,285 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pak.hpp"
+
+namespace paklib
+{
+	/**
+	 * \brief Write all of buf at off, retrying short and interrupted writes
+	 */
+	inline bool pwrite_all(int fd, const void* buf, size_t len, uint64_t off) {
+		auto* p = static_cast<const char*>(buf);
+		while (len > 0) {
+			ssize_t r = pwrite(fd, p, len, off);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0)
+				return false;
+			p += r;
+			off += r;
+			len -= r;
+		}
+		return true;
+	}
+
+	/**
+	 * \brief Copy a range of one file to an offset in another, using positional I/O only
+	 * Copies in the kernel with copy_file_range(), and through a buffer where the filesystems can't.
+	 */
+	inline bool copy_fd_range(int in, uint64_t off, uint64_t len, int out, uint64_t outoff) {
+		loff_t src = off, dst = outoff;
+		while (len > 0) {
+			ssize_t r = copy_file_range(in, &src, out, &dst, len, 0);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+				break;
+			if (r <= 0)
+				return false;
+			len -= r;
+		}
+
+		thread_local std::vector<char> buf;
+		if (len)
+			buf.resize(1 << 20);
+		while (len > 0) {
+			size_t n = std::min<uint64_t>(len, buf.size());
+			ssize_t r = pread(in, buf.data(), n, src);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r <= 0 || !pwrite_all(out, buf.data(), r, dst))
+				return false;
+			src += r;
+			dst += r;
+			len -= r;
+		}
+		return true;
+	}
+
+	/**
+	 * \brief Write an archive of the given entries of another, copying their data in the kernel
+	 * Entries whose data touches or overlaps in the source are copied as one range and keep
+	 * sharing it. Data is packed right after the header, followed by the directory. Entry
+	 * offsets must lie within the source.
+	 * \param ranges If not null, receives the number of ranges copied
+	 */
+	inline bool pak_copy_entries(int in, std::vector<pak_file_t> entries, int out, size_t* ranges = nullptr) {
+		struct run_t {
+			uint64_t src;
+			uint64_t size;
+			uint64_t out;
+		};
+
+		std::vector<int> order(entries.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [&](int a, int b) { return entries[a].offset < entries[b].offset; });
+
+		std::vector<run_t> runs;
+		uint64_t cursor = sizeof(pak_header_t);
+		for (int i : order) {
+			auto& f = entries[i];
+			if (!f.size) {
+				f.offset = sizeof(pak_header_t);
+				continue;
+			}
+			if (!runs.empty() && f.offset <= runs.back().src + runs.back().size) {
+				auto& r = runs.back();
+				uint64_t end = std::max<uint64_t>(r.src + r.size, uint64_t(f.offset) + f.size);
+				cursor += end - (r.src + r.size);
+				r.size = end - r.src;
+			}
+			else {
+				runs.push_back({f.offset, f.size, cursor});
+				cursor += f.size;
+			}
+			f.offset = runs.back().out + (f.offset - runs.back().src);
+		}
+
+		const uint64_t dir_size = entries.size() * sizeof(pak_file_t);
+		if (cursor + dir_size > UINT32_MAX)
+			return false;
+
+		pak_header_t hdr;
+		std::memcpy(hdr.id, "PACK", sizeof(hdr.id));
+		hdr.offset = cursor;
+		hdr.size = dir_size;
+
+		for (auto& r : runs)
+			if (!copy_fd_range(in, r.src, r.size, out, r.out))
+				return false;
+		if (ranges)
+			*ranges = runs.size();
+		return pwrite_all(out, entries.data(), dir_size, cursor)
+			&& pwrite_all(out, &hdr, sizeof(hdr), 0);
+	}
+
+	/**
+	 * \brief Updates an archive in place by appending to it
+	 * Changed files are appended after the end of the archive and a new directory after them.
+	 * The header is only pointed at the new directory once everything before it has reached
+	 * the disk, so a crash leaves either the old or the new archive. Replaced data and old
+	 * directories become dead space, which compact() reclaims by rewriting the archive.
+	 */
+	class pak_appender {
+	public:
+		pak_appender() = default;
+		pak_appender(const pak_appender&) = delete;
+		~pak_appender() { close(); }
+
+		bool open(const char* path) {
+			close();
+			m_path = path;
+			m_fd = ::open(path, O_RDWR | O_CLOEXEC);
+			if (m_fd < 0)
+				return false;
+
+			fd_source src(dup(m_fd));
+			pak_fd_archive archive;
+			if (!archive.open(std::move(src))) {
+				close();
+				return false;
+			}
+			m_files.assign(archive.files().begin(), archive.files().end());
+			m_end = archive.source().size();
+			for (size_t i = 0; i < m_files.size(); ++i)
+				m_index[std::string(archive.name(i))] = i;
+			return true;
+		}
+
+		void close() {
+			if (m_fd >= 0)
+				::close(m_fd);
+			m_fd = -1;
+			m_files.clear();
+			m_index.clear();
+			m_end = 0;
+		}
+
+		inline size_t file_count() const { return m_files.size(); }
+		inline std::span<const pak_file_t> files() const { return m_files; }
+		inline uint64_t size() const { return m_end; }
+
+		/**
+		 * \brief Bytes of the archive that neither the header, the directory nor any entry use
+		 */
+		uint64_t dead_space() const {
+			std::vector<std::pair<uint64_t, uint64_t>> ranges;
+			for (auto& f : m_files)
+				if (f.size)
+					ranges.push_back({f.offset, uint64_t(f.offset) + f.size});
+			std::sort(ranges.begin(), ranges.end());
+			uint64_t used = sizeof(pak_header_t) + m_files.size() * sizeof(pak_file_t), end = 0;
+			for (auto [lo, hi] : ranges) {
+				lo = std::max(lo, end);
+				if (hi > lo) {
+					used += hi - lo;
+					end = hi;
+				}
+			}
+			return m_end > used ? m_end - used : 0;
+		}
+
+		/**
+		 * \brief Append the contents of a file on disk as pak_path, replacing any entry of that name
+		 * Takes effect in the archive on commit().
+		 */
+		bool put(std::string_view pak_path, const char* disk_path) {
+			if (m_fd < 0 || pak_path.empty() || pak_path.size() > MAX_PAK_NAME_LEN)
+				return false;
+			int in = ::open(disk_path, O_RDONLY | O_CLOEXEC);
+			if (in < 0)
+				return false;
+			struct stat st;
+			bool ok = fstat(in, &st) == 0 && m_end + st.st_size <= UINT32_MAX
+				&& copy_fd_range(in, 0, st.st_size, m_fd, m_end);
+			::close(in);
+			if (!ok)
+				return false;
+
+			pak_file_t f {};
+			std::memcpy(f.name, pak_path.data(), pak_path.size());
+			f.offset = st.st_size ? m_end : sizeof(pak_header_t);
+			f.size = st.st_size;
+			m_end += st.st_size;
+
+			auto [it, added] = m_index.try_emplace(std::string(pak_path), m_files.size());
+			if (added)
+				m_files.push_back(f);
+			else
+				m_files[it->second] = f;
+			return true;
+		}
+
+		/**
+		 * \brief Drop an entry, its data becomes dead space. Takes effect on commit()
+		 */
+		bool remove(std::string_view pak_path) {
+			auto it = m_index.find(std::string(pak_path));
+			if (it == m_index.end())
+				return false;
+			size_t i = it->second;
+			m_index.erase(it);
+			if (i + 1 != m_files.size()) {
+				m_files[i] = m_files.back();
+				auto& f = m_files[i];
+				m_index[std::string(f.name, strnlen(f.name, MAX_PAK_NAME_LEN))] = i;
+			}
+			m_files.pop_back();
+			return true;
+		}
+
+		/**
+		 * \brief Write the directory after the appended data and switch the header over to it
+		 */
+		bool commit() {
+			if (m_fd < 0)
+				return false;
+			const uint64_t dir_size = m_files.size() * sizeof(pak_file_t);
+			if (m_end + dir_size > UINT32_MAX)
+				return false;
+
+			pak_header_t hdr;
+			std::memcpy(hdr.id, "PACK", sizeof(hdr.id));
+			hdr.offset = m_end;
+			hdr.size = dir_size;
+			if (!pwrite_all(m_fd, m_files.data(), dir_size, m_end) || fdatasync(m_fd) != 0
+				|| !pwrite_all(m_fd, &hdr, sizeof(hdr), 0) || fdatasync(m_fd) != 0)
+				return false;
+			m_end += dir_size;
+			return true;
+		}
+
+		/**
+		 * \brief Rewrite the archive without dead space, replacing it atomically
+		 */
+		bool compact() {
+			if (m_fd < 0)
+				return false;
+			auto tmp = m_path + ".tmp";
+			int out = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (out < 0)
+				return false;
+			bool ok = pak_copy_entries(m_fd, m_files, out) && fdatasync(out) == 0;
+			ok = (::close(out) == 0) && ok;
+			if (!ok || rename(tmp.c_str(), m_path.c_str()) != 0) {
+				::remove(tmp.c_str());
+				return false;
+			}
+			auto path = m_path;
+			return open(path.c_str());
+		}
+
+	protected:
+		std::string m_path;
+		int m_fd = -1;
+		uint64_t m_end = 0;		/* Where the next data goes, the end of the archive */
+		std::vector<pak_file_t> m_files;
+		std::unordered_map<std::string, size_t> m_index;
+	};
+}
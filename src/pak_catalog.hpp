@@ -0,0 +1,286 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pak.hpp"
+#include "task_scheduler.hpp"
+
+namespace paklib
+{
+#pragma pack(1)
+	struct pak_catalog_header_t {
+		char id[8];
+		uint32_t archive_count;
+		uint32_t reserved;
+		uint64_t entry_count;
+		uint64_t archives_offset;
+		uint64_t entries_offset;
+		uint64_t strings_offset;
+		uint64_t strings_size;
+	};
+
+	struct pak_catalog_archive_t {
+		uint64_t path_offset;	/* Into the string table */
+		uint32_t path_size;
+		uint32_t file_count;
+		int64_t mtime;			/* Nanoseconds, used to detect changed archives */
+		uint64_t size;
+	};
+
+	struct pak_catalog_entry_t {
+		uint32_t hash;			/* pak_name_hash() of the name */
+		uint32_t archive;
+		uint32_t entry;
+		char name[MAX_PAK_NAME_LEN];
+	};
+#pragma pack()
+
+	constexpr char PAK_CATALOG_ID[8] = {'P', 'A', 'K', 'C', 'A', 'T', '0', '1'};
+
+	/**
+	 * \brief Persisted index of the entries of many PAK files
+	 * Entries are stored sorted by name hash, so a lookup is a binary search over the mapped file.
+	 * Archive paths are stored relative to the directory the catalog lives in.
+	 */
+	class pak_catalog {
+	public:
+		struct match_t {
+			std::string archive;
+			int entry;
+		};
+
+		struct build_stats_t {
+			int archives = 0;	/* Archives in the new catalog */
+			int reused = 0;		/* Unchanged since the previous catalog */
+			int scanned = 0;	/* New or changed, and read again */
+			int failed = 0;		/* Could not be opened */
+		};
+
+		/**
+		 * \brief Map an existing catalog file
+		 */
+		bool open(const char* path) {
+			close();
+			if (!m_src.open(path) || m_src.size() < sizeof(pak_catalog_header_t))
+				return false;
+
+			std::memcpy(&m_header, m_src.data(), sizeof(m_header));
+			auto& h = m_header;
+			if (std::memcmp(h.id, PAK_CATALOG_ID, sizeof(h.id)) != 0
+				|| h.archives_offset + uint64_t(h.archive_count) * sizeof(pak_catalog_archive_t) > m_src.size()
+				|| h.entries_offset + h.entry_count * sizeof(pak_catalog_entry_t) > m_src.size()
+				|| h.strings_offset + h.strings_size > m_src.size()) {
+				close();
+				return false;
+			}
+
+			m_archives = std::span(reinterpret_cast<const pak_catalog_archive_t*>(m_src.data() + h.archives_offset), h.archive_count);
+			m_entries = std::span(reinterpret_cast<const pak_catalog_entry_t*>(m_src.data() + h.entries_offset), h.entry_count);
+			m_root = std::filesystem::path(path).parent_path();
+			return true;
+		}
+
+		void close() {
+			m_src.close();
+			m_archives = {};
+			m_entries = {};
+		}
+
+		inline int archive_count() const { return m_archives.size(); }
+		inline size_t entry_count() const { return m_entries.size(); }
+
+		/**
+		 * \brief Path of an archive, relative to the catalog's directory
+		 */
+		std::string_view archive_path(int archive) const {
+			auto& a = m_archives[archive];
+			if (a.path_offset + a.path_size > m_header.strings_size)
+				return {};
+			return std::string_view(reinterpret_cast<const char*>(m_src.data() + m_header.strings_offset + a.path_offset), a.path_size);
+		}
+
+		/**
+		 * \brief Find every archive containing an entry with this name
+		 */
+		std::vector<match_t> find(std::string_view name) const {
+			std::vector<match_t> matches;
+			if (name.size() > MAX_PAK_NAME_LEN)
+				return matches;
+
+			const uint32_t hash = pak_name_hash(name);
+			auto it = std::lower_bound(m_entries.begin(), m_entries.end(), hash,
+				[](const pak_catalog_entry_t& e, uint32_t h) { return e.hash < h; });
+			for (; it != m_entries.end() && it->hash == hash; ++it) {
+				if (std::string_view(it->name, strnlen(it->name, MAX_PAK_NAME_LEN)) != name || it->archive >= m_archives.size())
+					continue;
+				auto path = (m_root / std::filesystem::path(archive_path(it->archive))).lexically_normal();
+				matches.push_back({path.string(), int(it->entry)});
+			}
+			return matches;
+		}
+
+		/**
+		 * \brief Build or update the catalog at out from the PAK files under dir
+		 * If out already holds a catalog, archives whose size and modification time have not
+		 * changed keep their entries from it, and only new or changed archives are opened.
+		 * Archives are read in parallel on sched.
+		 */
+		static bool build(const std::filesystem::path& dir, const std::filesystem::path& out, task_scheduler& sched,
+			build_stats_t* stats = nullptr) {
+			namespace fs = std::filesystem;
+
+			struct pending_t {
+				std::string path;		/* Relative to the catalog's directory */
+				fs::path disk_path;
+				int64_t mtime;
+				uint64_t size;
+				uint32_t file_count = 0;
+				bool ok = true;
+				std::vector<pak_catalog_entry_t> entries;
+			};
+
+			build_stats_t st;
+			std::vector<pending_t> archives;
+			auto root = fs::absolute(out).parent_path();
+
+			std::error_code ec;
+			for (auto it = fs::recursive_directory_iterator(dir, ec); !ec && it != fs::recursive_directory_iterator(); it.increment(ec)) {
+				if (!it->is_regular_file() || it->path().extension() != ".pak")
+					continue;
+				struct stat sb;
+				if (::stat(it->path().c_str(), &sb) != 0)
+					continue;
+				pending_t p;
+				p.disk_path = it->path();
+				p.path = fs::absolute(it->path()).lexically_relative(root).string();
+				p.mtime = int64_t(sb.st_mtim.tv_sec) * 1000000000 + sb.st_mtim.tv_nsec;
+				p.size = sb.st_size;
+				archives.push_back(std::move(p));
+			}
+			if (ec)
+				return false;
+
+			/* Keep a stable order, so rebuilding an unchanged tree produces the same file */
+			std::sort(archives.begin(), archives.end(), [](auto& a, auto& b) { return a.path < b.path; });
+
+			/* Pull entries of unchanged archives out of the previous catalog */
+			pak_catalog prev;
+			if (prev.open(out.c_str())) {
+				std::vector<int> remap(prev.archive_count(), -1);
+				for (size_t i = 0; i < archives.size(); ++i) {
+					auto& p = archives[i];
+					auto it = std::lower_bound(prev.m_archives.begin(), prev.m_archives.end(), p.path,
+						[&](const pak_catalog_archive_t& a, const std::string& path) {
+							return prev.archive_path(&a - prev.m_archives.data()) < path;
+						});
+					if (it == prev.m_archives.end() || prev.archive_path(it - prev.m_archives.begin()) != p.path)
+						continue;
+					if (it->mtime == p.mtime && it->size == p.size) {
+						remap[it - prev.m_archives.begin()] = i;
+						p.file_count = it->file_count;
+						p.entries.reserve(it->file_count);
+					}
+				}
+				for (auto& e : prev.m_entries) {
+					if (e.archive < remap.size() && remap[e.archive] >= 0)
+						archives[remap[e.archive]].entries.push_back(e);
+				}
+				for (auto& p : archives)
+					if (p.file_count && p.entries.size() == p.file_count)
+						++st.reused;
+					else
+						p.entries.clear();
+			}
+
+			/* Read the directories of new and changed archives */
+			for (auto& p : archives) {
+				if (p.file_count && p.entries.size() == p.file_count)
+					continue;
+				sched.submit([&p] {
+					pak_fd_archive archive;
+					if (!archive.open(p.disk_path.c_str())) {
+						p.ok = false;
+						return;
+					}
+					p.file_count = archive.file_count();
+					p.entries.resize(archive.file_count());
+					for (int i = 0; i < archive.file_count(); ++i) {
+						auto& e = p.entries[i];
+						e.hash = pak_name_hash(archive.name(i));
+						e.entry = i;
+						std::memcpy(e.name, archive.files()[i].name, MAX_PAK_NAME_LEN);
+					}
+				});
+				++st.scanned;
+			}
+			sched.wait();
+
+			/* Lay out the new catalog */
+			std::vector<pak_catalog_archive_t> records;
+			std::vector<pak_catalog_entry_t> entries;
+			std::string strings;
+			for (auto& p : archives) {
+				if (!p.ok) {
+					++st.failed;
+					continue;
+				}
+				uint32_t index = records.size();
+				records.push_back({strings.size(), uint32_t(p.path.size()), p.file_count, p.mtime, p.size});
+				strings += p.path;
+				for (auto& e : p.entries) {
+					entries.push_back(e);
+					entries.back().archive = index;
+				}
+			}
+			st.archives = records.size();
+
+			std::sort(entries.begin(), entries.end(), [](auto& a, auto& b) {
+				if (a.hash != b.hash)
+					return a.hash < b.hash;
+				return a.archive != b.archive ? a.archive < b.archive : a.entry < b.entry;
+			});
+
+			pak_catalog_header_t hdr {};
+			std::memcpy(hdr.id, PAK_CATALOG_ID, sizeof(hdr.id));
+			hdr.archive_count = records.size();
+			hdr.entry_count = entries.size();
+			hdr.archives_offset = sizeof(hdr);
+			hdr.entries_offset = hdr.archives_offset + records.size() * sizeof(pak_catalog_archive_t);
+			hdr.strings_offset = hdr.entries_offset + entries.size() * sizeof(pak_catalog_entry_t);
+			hdr.strings_size = strings.size();
+
+			/* Write to the side and rename over the old one, so readers never see a partial catalog */
+			prev.close();
+			auto tmp = out;
+			tmp += ".tmp";
+			FILE* fp = fopen(tmp.c_str(), "wb");
+			if (!fp)
+				return false;
+			bool ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+				&& fwrite(records.data(), sizeof(pak_catalog_archive_t), records.size(), fp) == records.size()
+				&& fwrite(entries.data(), sizeof(pak_catalog_entry_t), entries.size(), fp) == entries.size()
+				&& fwrite(strings.data(), 1, strings.size(), fp) == strings.size();
+			ok = (fclose(fp) == 0) && ok;
+			if (!ok || rename(tmp.c_str(), out.c_str()) != 0) {
+				remove(tmp.c_str());
+				return false;
+			}
+
+			if (stats)
+				*stats = st;
+			return true;
+		}
+
+	protected:
+		mmap_source m_src;
+		pak_catalog_header_t m_header {};
+		std::span<const pak_catalog_archive_t> m_archives;
+		std::span<const pak_catalog_entry_t> m_entries;
+		std::filesystem::path m_root;
+	};
+}
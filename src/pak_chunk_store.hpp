@@ -0,0 +1,352 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "pak.hpp"
+#include "sha256.hpp"
+#include "task_scheduler.hpp"
+
+namespace paklib
+{
+	/* Bounds of content-defined chunks. Cuts are normalized towards the average size */
+	constexpr size_t CDC_MIN_SIZE = 16 * 1024;
+	constexpr size_t CDC_AVG_SIZE = 64 * 1024;
+	constexpr size_t CDC_MAX_SIZE = 256 * 1024;
+
+	namespace detail
+	{
+		/* Gear table for the rolling hash, filled from splitmix64 so it is the same everywhere */
+		constexpr std::array<uint64_t, 256> make_gear_table() {
+			std::array<uint64_t, 256> t {};
+			uint64_t x = 0x50414b544f4f4cull;
+			for (auto& v : t) {
+				uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+				v = z ^ (z >> 31);
+			}
+			return t;
+		}
+
+		inline constexpr auto gear_table = make_gear_table();
+
+		/* Cut masks over the high bits of the hash: stricter below the average size, looser above it */
+		constexpr uint64_t CDC_MASK_SMALL = ((1ull << 18) - 1) << 46;
+		constexpr uint64_t CDC_MASK_LARGE = ((1ull << 14) - 1) << 50;
+	}
+
+	/**
+	 * \brief Length of the next content-defined chunk at the start of data
+	 * Uses a gear rolling hash, so an edit only moves the cut points near it and the chunks
+	 * before and after stay identical.
+	 */
+	inline size_t cdc_next_chunk(const uint8_t* data, size_t len) {
+		if (len <= CDC_MIN_SIZE)
+			return len;
+		const size_t normal = len < CDC_AVG_SIZE ? len : CDC_AVG_SIZE;
+		const size_t max = len < CDC_MAX_SIZE ? len : CDC_MAX_SIZE;
+
+		uint64_t h = 0;
+		size_t i = CDC_MIN_SIZE;
+		for (; i < normal; ++i) {
+			h = (h << 1) + detail::gear_table[data[i]];
+			if (!(h & detail::CDC_MASK_SMALL))
+				return i + 1;
+		}
+		for (; i < max; ++i) {
+			h = (h << 1) + detail::gear_table[data[i]];
+			if (!(h & detail::CDC_MASK_LARGE))
+				return i + 1;
+		}
+		return max;
+	}
+
+#pragma pack(1)
+	struct pak_recipe_header_t {
+		char id[8];
+		uint64_t archive_size;
+		uint32_t file_count;
+		pak_header_t header;
+		/* Followed by file_count pak_file_t, then for each entry a uint32_t chunk count and its chunks */
+	};
+
+	struct pak_recipe_chunk_t {
+		sha256_digest_t id;
+		uint32_t size;
+	};
+#pragma pack()
+
+	constexpr char PAK_RECIPE_ID[8] = {'P', 'A', 'K', 'R', 'C', 'P', '0', '1'};
+
+	/**
+	 * \brief Directory of deduplicated chunks shared by many PAK files
+	 * Entry data is split with content-defined chunking and each unique chunk is stored once,
+	 * under chunks/ named by its SHA-256. Each archive added gets a recipe under recipes/ with
+	 * its header, directory and the chunks of every entry, from which it can be rebuilt.
+	 *
+	 * Only the header, directory and entry data are kept. Bytes of the archive that no entry
+	 * covers come back as zeros when materialized.
+	 */
+	class pak_chunk_store {
+	public:
+		enum class add_result {
+			added,		/* Recipe written */
+			unchanged,	/* An identical recipe was already stored under the name */
+			conflict,	/* A different archive is stored under the name */
+			error,
+		};
+
+		struct stats_t {
+			std::atomic<uint64_t> bytes {0};		/* Entry data processed */
+			std::atomic<uint64_t> chunks {0};
+			std::atomic<uint64_t> new_chunks {0};	/* Chunks that were not in the store yet */
+			std::atomic<uint64_t> new_bytes {0};
+		};
+
+		/**
+		 * \brief Open the store at dir, creating it if needed
+		 */
+		bool open(const std::filesystem::path& dir) {
+			std::error_code ec;
+			m_root = dir;
+			std::filesystem::create_directories(m_root / "recipes", ec);
+			for (int i = 0; i < 256 && !ec; ++i) {
+				const char sub[] = {HEX_DIGITS[i >> 4], HEX_DIGITS[i & 15], 0};
+				std::filesystem::create_directories(m_root / "chunks" / sub, ec);
+			}
+			return !ec;
+		}
+
+		/**
+		 * \brief Names of the archives in the store
+		 */
+		std::vector<std::string> archives() const {
+			std::vector<std::string> names;
+			std::error_code ec;
+			for (auto& e : std::filesystem::directory_iterator(m_root / "recipes", ec))
+				if (e.path().extension() == ".recipe")
+					names.push_back(e.path().stem().string());
+			std::sort(names.begin(), names.end());
+			return names;
+		}
+
+		/**
+		 * \brief Chunk the entries of a PAK file into the store and write its recipe
+		 * Entries are chunked and hashed in parallel on sched. The recipe is stored under name,
+		 * or the file name of the archive if name is empty. A recipe of that name is only
+		 * replaced by an identical one, so different archives that share a file name need
+		 * names of their own.
+		 */
+		add_result add(const std::filesystem::path& pak, task_scheduler& sched, stats_t* stats = nullptr,
+			const std::string& name = {}) {
+			auto path = recipe_path(name.empty() ? pak.filename().string() : name);
+			if (path.empty())
+				return add_result::error;
+
+			pak_mmap_archive archive;
+			if (!archive.open(pak.c_str()))
+				return add_result::error;
+
+			stats_t local;
+			stats_t& st = stats ? *stats : local;
+			std::vector<std::vector<pak_recipe_chunk_t>> chunks(archive.file_count());
+			std::atomic<bool> ok {true};
+
+			for (int i = 0; i < archive.file_count(); ++i) {
+				sched.submit([&, i] {
+					auto data = archive.view(i);
+					if (data.size() != archive.files()[i].size) {
+						ok = false;
+						return;
+					}
+
+					/* Finding cut points is cheap and sequential, hashing and storing is not, so hand those out */
+					std::vector<size_t> cuts;
+					for (size_t off = 0; off < data.size(); off += cdc_next_chunk(data.data() + off, data.size() - off))
+						cuts.push_back(off);
+					chunks[i].resize(cuts.size());
+					st.chunks += cuts.size();
+					st.bytes += data.size();
+
+					for (size_t k = 0; k < cuts.size(); ++k) {
+						size_t off = cuts[k];
+						size_t n = (k + 1 < cuts.size() ? cuts[k + 1] : data.size()) - off;
+						sched.submit([&, i, k, off, n] {
+							auto* p = archive.view(i).data() + off;
+							auto& c = chunks[i][k];
+							c = {sha256::hash(p, n), uint32_t(n)};
+							bool added = false;
+							if (!put_chunk(c.id, p, n, added))
+								ok = false;
+							if (added) {
+								st.new_chunks++;
+								st.new_bytes += n;
+							}
+						});
+					}
+				});
+			}
+			sched.wait();
+			if (!ok)
+				return add_result::error;
+
+			/* Build the recipe */
+			pak_recipe_header_t hdr {};
+			std::memcpy(hdr.id, PAK_RECIPE_ID, sizeof(hdr.id));
+			hdr.archive_size = archive.source().size();
+			hdr.file_count = archive.file_count();
+			hdr.header = archive.header();
+
+			std::vector<uint8_t> recipe;
+			auto append = [&recipe](const void* p, size_t n) {
+				recipe.insert(recipe.end(), static_cast<const uint8_t*>(p), static_cast<const uint8_t*>(p) + n);
+			};
+			append(&hdr, sizeof(hdr));
+			append(archive.files().data(), archive.files().size_bytes());
+			for (auto& list : chunks) {
+				uint32_t n = list.size();
+				append(&n, sizeof(n));
+				append(list.data(), n * sizeof(pak_recipe_chunk_t));
+			}
+
+			/* Never replace the recipe of a different archive, its chunks could not be found again */
+			mmap_source existing;
+			if (existing.open(path.c_str())) {
+				if (sha256::hash(existing.data(), existing.size()) != sha256::hash(recipe.data(), recipe.size()))
+					return add_result::conflict;
+				return add_result::unchanged;
+			}
+
+			auto tmp = path;
+			tmp += ".tmp";
+			int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+				return add_result::error;
+			bool wrote = write(fd, recipe.data(), recipe.size()) == ssize_t(recipe.size());
+			wrote = (::close(fd) == 0) && wrote;
+			/* link() fails if another writer got there first, rather than replacing its recipe */
+			if (!wrote || link(tmp.c_str(), path.c_str()) != 0) {
+				remove(tmp.c_str());
+				return add_result::error;
+			}
+			remove(tmp.c_str());
+			return add_result::added;
+		}
+
+		/**
+		 * \brief Rebuild an archive from its recipe
+		 * Entries are assembled in parallel on sched.
+		 */
+		bool materialize(const std::string& name, const std::filesystem::path& out, task_scheduler& sched) {
+			mmap_source recipe;
+			if (!recipe.open(recipe_path(name).c_str()) || recipe.size() < sizeof(pak_recipe_header_t))
+				return false;
+
+			pak_recipe_header_t hdr;
+			std::memcpy(&hdr, recipe.data(), sizeof(hdr));
+			if (std::memcmp(hdr.id, PAK_RECIPE_ID, sizeof(hdr.id)) != 0)
+				return false;
+
+			/* Walk the recipe once to find where each entry's chunk list starts */
+			uint64_t pos = sizeof(hdr) + uint64_t(hdr.file_count) * sizeof(pak_file_t);
+			if (pos > recipe.size())
+				return false;
+			auto* files = reinterpret_cast<const pak_file_t*>(recipe.data() + sizeof(hdr));
+			std::vector<std::span<const pak_recipe_chunk_t>> lists(hdr.file_count);
+			for (auto& list : lists) {
+				uint32_t n;
+				if (!recipe.read(&n, sizeof(n), pos) || pos + sizeof(n) + uint64_t(n) * sizeof(pak_recipe_chunk_t) > recipe.size())
+					return false;
+				list = std::span(reinterpret_cast<const pak_recipe_chunk_t*>(recipe.data() + pos + sizeof(n)), n);
+				pos += sizeof(n) + uint64_t(n) * sizeof(pak_recipe_chunk_t);
+			}
+
+			int fd = ::open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+				return false;
+			bool ok = ftruncate(fd, hdr.archive_size) == 0
+				&& pwrite(fd, &hdr.header, sizeof(hdr.header), 0) == sizeof(hdr.header)
+				&& pwrite(fd, files, hdr.file_count * sizeof(pak_file_t), hdr.header.offset) == ssize_t(hdr.file_count * sizeof(pak_file_t));
+
+			std::atomic<bool> good {ok};
+			for (uint32_t i = 0; ok && i < hdr.file_count; ++i) {
+				sched.submit([&, i] {
+					uint64_t off = files[i].offset;
+					std::vector<uint8_t> buf;
+					for (auto& c : lists[i]) {
+						buf.resize(c.size);
+						if (!get_chunk(c.id, buf.data(), c.size) || pwrite(fd, buf.data(), c.size, off) != ssize_t(c.size)) {
+							good = false;
+							return;
+						}
+						off += c.size;
+					}
+				});
+			}
+			sched.wait();
+
+			ok = good;
+			ok = (::close(fd) == 0) && ok;
+			return ok;
+		}
+
+	protected:
+		static constexpr char HEX_DIGITS[] = "0123456789abcdef";
+
+		/**
+		 * \brief Path of the recipe of name, or an empty path if name is not a plain file name
+		 */
+		std::filesystem::path recipe_path(const std::string& name) const {
+			if (name.empty() || name == "." || name == ".." || name.find('/') != std::string::npos)
+				return {};
+			return m_root / "recipes" / (name + ".recipe");
+		}
+
+		std::filesystem::path chunk_path(const sha256_digest_t& id) const {
+			char hex[64];
+			for (int i = 0; i < 32; ++i) {
+				hex[i * 2] = HEX_DIGITS[id[i] >> 4];
+				hex[i * 2 + 1] = HEX_DIGITS[id[i] & 15];
+			}
+			return m_root / "chunks" / std::string(hex, 2) / std::string(hex + 2, 62);
+		}
+
+		/**
+		 * \brief Store a chunk unless it is already there
+		 * Chunks are written to a temporary name and renamed, so concurrent writers of the
+		 * same chunk are harmless and readers never see a partial chunk.
+		 */
+		bool put_chunk(const sha256_digest_t& id, const uint8_t* data, size_t len, bool& added) {
+			auto path = chunk_path(id);
+			added = false;
+			if (access(path.c_str(), F_OK) == 0)
+				return true;
+
+			auto tmp = path;
+			tmp += ".tmp." + std::to_string(gettid());
+			int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (fd < 0)
+				return false;
+			bool ok = write(fd, data, len) == ssize_t(len);
+			ok = (::close(fd) == 0) && ok;
+			if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+				remove(tmp.c_str());
+				return false;
+			}
+			added = true;
+			return true;
+		}
+
+		bool get_chunk(const sha256_digest_t& id, uint8_t* out, size_t len) const {
+			fd_source src;
+			return src.open(chunk_path(id).c_str()) && src.size() == len && src.read(out, len, 0);
+		}
+
+		std::filesystem::path m_root;
+	};
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/aio_abi.h>
+#include <sys/syscall.h>
+
+namespace paklib
+{
+	/* Offsets, lengths and buffers of O_DIRECT I/O must be multiples of this */
+	constexpr size_t PAK_DIRECT_ALIGN = 4096;
+
+	/* Size of each O_DIRECT read or write */
+	constexpr size_t PAK_DIRECT_BLOCK = 1 << 20;
+
+	/* Reads each pak_direct_reader keeps in flight */
+	constexpr unsigned PAK_DIRECT_QUEUE_DEPTH = 8;
+
+	/**
+	 * \brief Open a file with O_DIRECT, or without it if the filesystem does not support it
+	 */
+	inline int pak_open_direct(int dirfd, const char* path, int flags, mode_t mode = 0644) {
+		int fd = ::openat(dirfd, path, flags | O_DIRECT | O_CLOEXEC, mode);
+		if (fd < 0 && errno == EINVAL)
+			fd = ::openat(dirfd, path, flags | O_CLOEXEC, mode);
+		return fd;
+	}
+
+	inline int pak_open_direct(const char* path, int flags, mode_t mode = 0644) {
+		return pak_open_direct(AT_FDCWD, path, flags, mode);
+	}
+
+	/**
+	 * \brief Shared pool of PAK_DIRECT_BLOCK sized, suitably aligned buffers
+	 */
+	class pak_direct_pool {
+	public:
+		static pak_direct_pool& instance() {
+			static pak_direct_pool pool;
+			return pool;
+		}
+
+		~pak_direct_pool() {
+			for (auto* p : m_free)
+				free(p);
+		}
+
+		uint8_t* acquire() {
+			{
+				std::lock_guard lock(m_lock);
+				if (!m_free.empty()) {
+					auto* p = m_free.back();
+					m_free.pop_back();
+					return p;
+				}
+			}
+			void* p = nullptr;
+			return posix_memalign(&p, PAK_DIRECT_ALIGN, PAK_DIRECT_BLOCK) == 0 ? static_cast<uint8_t*>(p) : nullptr;
+		}
+
+		void release(uint8_t* p) {
+			if (!p)
+				return;
+			std::lock_guard lock(m_lock);
+			m_free.push_back(p);
+		}
+
+	protected:
+		std::mutex m_lock;
+		std::vector<uint8_t*> m_free;
+	};
+
+	/**
+	 * \brief Streams byte ranges of a file through O_DIRECT, keeping several reads in flight
+	 * Reads are submitted with Linux native AIO in aligned blocks and handed to the caller in
+	 * order, trimmed to the requested range, so ranges need not be aligned. Without AIO the
+	 * blocks are read one at a time. A reader is used by one thread at a time.
+	 */
+	class pak_direct_reader {
+	public:
+		explicit pak_direct_reader(unsigned depth = PAK_DIRECT_QUEUE_DEPTH) {
+			for (unsigned i = 0; i < depth; ++i)
+				if (auto* p = pak_direct_pool::instance().acquire())
+					m_bufs.push_back(p);
+			if (syscall(SYS_io_setup, m_bufs.size(), &m_ctx) != 0)
+				m_ctx = 0;
+		}
+
+		pak_direct_reader(const pak_direct_reader&) = delete;
+		pak_direct_reader(pak_direct_reader&&) = delete;
+
+		~pak_direct_reader() {
+			if (m_ctx)
+				syscall(SYS_io_destroy, m_ctx);
+			for (auto* p : m_bufs)
+				pak_direct_pool::instance().release(p);
+		}
+
+		/**
+		 * \brief Read [off, off + len) of fd, calling sink(data, n) for consecutive pieces of it
+		 * \returns False if a read failed, came up short or the sink returned false
+		 */
+		template<class Sink>
+		bool read(int fd, uint64_t off, uint64_t len, Sink&& sink) {
+			if (!len)
+				return true;
+			if (m_bufs.empty())
+				return false;
+
+			const uint64_t first = off & ~uint64_t(PAK_DIRECT_ALIGN - 1);
+			const uint64_t end = off + len;
+			const uint64_t blocks = (end - first + PAK_DIRECT_BLOCK - 1) / PAK_DIRECT_BLOCK;
+			const unsigned depth = m_bufs.size();
+
+			/* Block b always goes to slot b % depth, so completions can be put back in order */
+			std::vector<iocb> cbs(depth);
+			std::vector<int64_t> result(depth);
+			std::vector<bool> done(depth);
+			uint64_t next = 0, consumed = 0;
+			unsigned pending = 0;	/* Submitted to AIO and not reaped yet */
+			bool ok = true;
+
+			auto block_len = [&](uint64_t b) {
+				uint64_t start = first + b * PAK_DIRECT_BLOCK;
+				uint64_t n = end - start < PAK_DIRECT_BLOCK ? end - start : PAK_DIRECT_BLOCK;
+				return (n + PAK_DIRECT_ALIGN - 1) & ~uint64_t(PAK_DIRECT_ALIGN - 1);
+			};
+
+			auto submit = [&]() {
+				while (ok && next < blocks && next - consumed < depth) {
+					unsigned s = next % depth;
+					auto& cb = cbs[s];
+					std::memset(&cb, 0, sizeof(cb));
+					cb.aio_fildes = fd;
+					cb.aio_lio_opcode = IOCB_CMD_PREAD;
+					cb.aio_buf = reinterpret_cast<uintptr_t>(m_bufs[s]);
+					cb.aio_nbytes = block_len(next);
+					cb.aio_offset = first + next * PAK_DIRECT_BLOCK;
+					cb.aio_data = s;
+					done[s] = false;
+
+					iocb* p = &cb;
+					if (m_ctx && syscall(SYS_io_submit, m_ctx, 1, &p) == 1)
+						++pending;
+					else {
+						/* No AIO, or the submission was refused: read it right away */
+						ssize_t r;
+						do
+							r = pread(fd, m_bufs[s], cb.aio_nbytes, cb.aio_offset);
+						while (r < 0 && errno == EINTR);
+						result[s] = r < 0 ? -errno : r;
+						done[s] = true;
+					}
+					++next;
+				}
+			};
+
+			submit();
+			for (uint64_t b = 0; b < next; ++b) {
+				const unsigned s = b % depth;
+				while (!done[s]) {
+					io_event ev[PAK_DIRECT_QUEUE_DEPTH * 2];
+					long n = syscall(SYS_io_getevents, m_ctx, 1, long(sizeof(ev) / sizeof(ev[0])), ev, nullptr);
+					if (n < 0 && errno == EINTR)
+						continue;
+					if (n < 0) {
+						ok = false;
+						break;
+					}
+					pending -= n;
+					for (long i = 0; i < n; ++i) {
+						result[ev[i].data] = ev[i].res;
+						done[ev[i].data] = true;
+					}
+				}
+				++consumed;
+
+				/* Trim the block to the requested range */
+				const uint64_t start = first + b * PAK_DIRECT_BLOCK;
+				const uint64_t from = off > start ? off - start : 0;
+				const uint64_t to = end - start < PAK_DIRECT_BLOCK ? end - start : PAK_DIRECT_BLOCK;
+				if (!ok || result[s] < int64_t(to))
+					ok = false;
+				else if (!sink(m_bufs[s] + from, size_t(to - from)))
+					ok = false;
+
+				if (ok)
+					submit();
+				else {
+					/* Wait out the rest so their buffers are not reused under them */
+					io_event ev[PAK_DIRECT_QUEUE_DEPTH * 2];
+					while (pending) {
+						long n = syscall(SYS_io_getevents, m_ctx, 1, long(sizeof(ev) / sizeof(ev[0])), ev, nullptr);
+						if (n < 0 && errno != EINTR)
+							break;
+						pending -= n > 0 ? n : 0;
+					}
+					break;
+				}
+			}
+			return ok;
+		}
+
+	protected:
+		aio_context_t m_ctx = 0;
+		std::vector<uint8_t*> m_bufs;
+	};
+
+	/**
+	 * \brief Writes a stream of bytes to a file opened with O_DIRECT, starting at an aligned offset
+	 * Data is gathered into an aligned block and written whenever the block fills. flush() pads
+	 * the last partial block to the alignment, so the caller must ftruncate() the file to its
+	 * real size afterwards.
+	 */
+	class pak_direct_writer {
+	public:
+		pak_direct_writer(int fd, uint64_t offset)
+			: m_fd(fd), m_offset(offset), m_buf(pak_direct_pool::instance().acquire()) {}
+
+		pak_direct_writer(const pak_direct_writer&) = delete;
+		pak_direct_writer(pak_direct_writer&&) = delete;
+
+		~pak_direct_writer() { pak_direct_pool::instance().release(m_buf); }
+
+		bool write(const uint8_t* data, size_t len) {
+			if (!m_buf)
+				return false;
+			while (len > 0) {
+				size_t n = PAK_DIRECT_BLOCK - m_fill < len ? PAK_DIRECT_BLOCK - m_fill : len;
+				std::memcpy(m_buf + m_fill, data, n);
+				m_fill += n;
+				data += n;
+				len -= n;
+				if (m_fill == PAK_DIRECT_BLOCK && !flush())
+					return false;
+			}
+			return true;
+		}
+
+		bool flush() {
+			if (!m_fill)
+				return true;
+			size_t n = (m_fill + PAK_DIRECT_ALIGN - 1) & ~(PAK_DIRECT_ALIGN - 1);
+			std::memset(m_buf + m_fill, 0, n - m_fill);
+			for (size_t done = 0; done < n;) {
+				ssize_t r = pwrite(m_fd, m_buf + done, n - done, m_offset + done);
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r <= 0)
+					return false;
+				done += r;
+			}
+			m_offset += m_fill;
+			m_fill = 0;
+			return true;
+		}
+
+	protected:
+		int m_fd;
+		uint64_t m_offset;
+		uint8_t* m_buf;
+		size_t m_fill = 0;
+	};
+}
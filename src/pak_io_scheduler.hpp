@@ -0,0 +1,217 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pak.hpp"
+
+namespace paklib
+{
+	/**
+	 * \brief Priority classes of pak_io_scheduler, most urgent first
+	 */
+	enum class pak_io_priority {
+		urgent,		/* Something is blocked waiting on it */
+		normal,
+		prefetch,	/* Probably needed soon */
+		background,	/* Bulk work nobody is waiting on */
+	};
+
+	constexpr size_t PAK_IO_PRIORITY_COUNT = 4;
+
+	/* Requests are served in slices of this size, so urgent requests can get in between */
+	constexpr size_t PAK_IO_SLICE_SIZE = 256 * 1024;
+
+	/**
+	 * \brief Reads entries of an archive on a pool of I/O threads, in priority order
+	 * Idle threads always take the most urgent queued request whose class is below its
+	 * concurrency limit. Requests are read a slice at a time and go back to the front of their
+	 * queue between slices, so a newly queued urgent read overtakes bulk reads that are already
+	 * in progress instead of waiting for them to finish. The archive must outlive the scheduler.
+	 */
+	template<pak_byte_source Source>
+	class pak_io_scheduler {
+		static_assert(!std::is_same_v<Source, stdio_source>, "stdio archives can not be read from several threads");
+
+	public:
+		using limits_t = std::array<unsigned, PAK_IO_PRIORITY_COUNT>;
+
+		/**
+		 * \param threads Number of I/O threads
+		 * \param limits Most requests of each class in flight at once. By default prefetch reads
+		 *  may use half the threads and background reads one, so they can not starve the rest.
+		 *  Limits of 0 are raised to 1, as requests of that class would never be served.
+		 */
+		explicit pak_io_scheduler(const basic_pak_archive<Source>& archive, unsigned threads = 4, limits_t limits = {})
+			: m_archive(archive) {
+			if (threads == 0)
+				threads = 1;
+			if (limits == limits_t{})
+				limits = {threads, threads, threads > 1 ? threads / 2 : 1, 1};
+			for (auto& l : limits)
+				if (l == 0)
+					l = 1;
+			m_limits = limits;
+			for (unsigned i = 0; i < threads; ++i)
+				m_threads.emplace_back([this] { run(); });
+		}
+
+		pak_io_scheduler(const pak_io_scheduler&) = delete;
+		pak_io_scheduler(pak_io_scheduler&&) = delete;
+
+		/**
+		 * \brief Stops the I/O threads once every queued request has been served
+		 */
+		~pak_io_scheduler() {
+			{
+				std::lock_guard lock(m_lock);
+				m_stop = true;
+			}
+			m_wake.notify_all();
+			for (auto& t : m_threads)
+				t.join();
+		}
+
+		/**
+		 * \brief Queue a read of part of an entry, see basic_pak_archive::read_range()
+		 * \returns Future for the number of bytes read
+		 */
+		std::future<size_t> read_range(int index, uint64_t offset, void* outbuf, size_t len, pak_io_priority prio) {
+			auto promise = std::make_shared<std::promise<size_t>>();
+			auto future = promise->get_future();
+			submit(index, offset, static_cast<uint8_t*>(outbuf), len, prio, [promise](size_t n, bool) {
+				promise->set_value(n);
+			});
+			return future;
+		}
+
+		/**
+		 * \brief Queue a read of a whole entry into a buffer allocated from mr
+		 * \returns Future for the buffer, which is null if the entry does not exist or could not be read
+		 */
+		std::future<pak_buffer> read_file(int index, pak_io_priority prio, std::pmr::memory_resource* mr = pak_buffer_pool()) {
+			auto promise = std::make_shared<std::promise<pak_buffer>>();
+			auto future = promise->get_future();
+			if (index < 0 || index >= m_archive.file_count()) {
+				promise->set_value({});
+				return future;
+			}
+
+			auto buf = std::make_shared<pak_buffer>(m_archive.files()[index].size, mr);
+			submit(index, 0, buf->data(), buf->size(), prio, [promise, buf](size_t n, bool ok) {
+				if (!ok || n != buf->size())
+					buf->reset();
+				promise->set_value(std::move(*buf));
+			});
+			return future;
+		}
+
+		/**
+		 * \brief Number of requests of a class that are queued or in flight
+		 */
+		size_t pending(pak_io_priority prio) const {
+			std::lock_guard lock(m_lock);
+			auto c = size_t(prio);
+			return m_queues[c].size() + m_inflight[c];
+		}
+
+	protected:
+		struct request_t {
+			int index;
+			uint64_t offset;
+			uint8_t* out;
+			size_t len;
+			size_t done = 0;
+			bool ok = true;
+			pak_io_priority prio;
+			std::function<void(size_t, bool)> complete;
+		};
+
+		void submit(int index, uint64_t offset, uint8_t* out, size_t len, pak_io_priority prio, std::function<void(size_t, bool)> complete) {
+			/* Clamp to the entry, like basic_pak_archive::read_range() */
+			if (index < 0 || index >= m_archive.file_count()) {
+				complete(0, false);
+				return;
+			}
+			uint64_t size = m_archive.files()[index].size;
+			if (offset >= size)
+				len = 0;
+			else if (len > size - offset)
+				len = size - offset;
+
+			auto req = std::make_unique<request_t>(request_t{index, offset, out, len, 0, true, prio, std::move(complete)});
+			{
+				std::lock_guard lock(m_lock);
+				m_queues[size_t(prio)].push_back(std::move(req));
+			}
+			m_wake.notify_one();
+		}
+
+		/* Most urgent class with queued requests and room under its limit, or -1. Call with m_lock held */
+		int next_class() const {
+			for (size_t c = 0; c < PAK_IO_PRIORITY_COUNT; ++c)
+				if (!m_queues[c].empty() && m_inflight[c] < m_limits[c])
+					return c;
+			return -1;
+		}
+
+		bool idle() const {
+			for (size_t c = 0; c < PAK_IO_PRIORITY_COUNT; ++c)
+				if (!m_queues[c].empty())
+					return false;
+			return true;
+		}
+
+		void run() {
+			std::unique_lock lock(m_lock);
+			for (;;) {
+				int c;
+				m_wake.wait(lock, [&] { return (c = next_class()) >= 0 || (m_stop && idle()); });
+				if (c < 0)
+					return;
+
+				auto req = std::move(m_queues[c].front());
+				m_queues[c].pop_front();
+				m_inflight[c]++;
+				lock.unlock();
+
+				/* Read one slice */
+				size_t want = req->len - req->done < PAK_IO_SLICE_SIZE ? req->len - req->done : PAK_IO_SLICE_SIZE;
+				if (want) {
+					size_t got = m_archive.read_range(req->index, req->offset + req->done, req->out + req->done, want);
+					req->done += got;
+					req->ok = got == want;
+				}
+
+				const bool finished = !req->ok || req->done == req->len;
+				if (finished)
+					req->complete(req->done, req->ok);
+
+				lock.lock();
+				m_inflight[c]--;
+				if (!finished)
+					m_queues[c].push_front(std::move(req));
+
+				/* A slot in class c opened up, and the request may be back in the queue */
+				m_wake.notify_all();
+			}
+		}
+
+		const basic_pak_archive<Source>& m_archive;
+		limits_t m_limits;
+		std::vector<std::thread> m_threads;
+
+		mutable std::mutex m_lock;
+		std::condition_variable m_wake;
+		std::array<std::deque<std::unique_ptr<request_t>>, PAK_IO_PRIORITY_COUNT> m_queues;
+		std::array<unsigned, PAK_IO_PRIORITY_COUNT> m_inflight {};
+		bool m_stop = false;
+	};
+}
@@ -0,0 +1,243 @@
+#pragma once
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "pak.hpp"
+
+namespace paklib
+{
+	/* Successors remembered per entry */
+	constexpr int PAK_PREFETCH_WAYS = 4;
+
+	/**
+	 * \brief Learns which entries tend to be read after which, and reads ahead for them
+	 * Keeps a first-order successor table: for each entry, the entries most often read right
+	 * after it. When an entry is read, its likeliest successors are handed to the source's
+	 * readahead() (posix_fadvise or madvise), so the kernel loads them in the background.
+	 *
+	 * The table is a fixed-size array sized from the memory budget; entries whose slots
+	 * collide age each other out. Access order is tracked per prefetcher, so loaders that read
+	 * several independent chains at once should use one archive and prefetcher per chain.
+	 */
+	template<pak_byte_source Source>
+	class pak_prefetcher : public pak_access_observer {
+	public:
+		struct stats_t {
+			uint64_t accesses = 0;
+			uint64_t predicted = 0;		/* Accesses that followed an entry with predictions */
+			uint64_t hits = 0;			/* ... and were among those predictions */
+			uint64_t issued = 0;		/* Readaheads issued */
+			uint64_t issued_bytes = 0;
+
+			inline double hit_rate() const { return predicted ? double(hits) / predicted : 0; }
+		};
+
+		/**
+		 * \param memory_budget Bytes the successor table may use
+		 * \param fanout How many of the likeliest successors to read ahead
+		 * \param max_bytes Most bytes to read ahead per predicted entry
+		 */
+		explicit pak_prefetcher(const basic_pak_archive<Source>& archive, size_t memory_budget = 1 << 20,
+			int fanout = 2, uint64_t max_bytes = 4 << 20)
+			: m_archive(archive), m_fanout(fanout < PAK_PREFETCH_WAYS ? fanout : PAK_PREFETCH_WAYS), m_maxBytes(max_bytes) {
+			size_t rows = 64;
+			while (rows * 2 * sizeof(row_t) <= memory_budget)
+				rows *= 2;
+			m_rows.assign(rows, row_t{});
+		}
+
+		inline stats_t stats() const {
+			std::lock_guard lock(m_lock);
+			return m_stats;
+		}
+
+		inline size_t memory_usage() const { return m_rows.size() * sizeof(row_t); }
+
+		void on_access(int index) override {
+			int predicted[PAK_PREFETCH_WAYS];
+			int count = 0;
+			{
+				std::lock_guard lock(m_lock);
+				m_stats.accesses++;
+				if (m_lastPredicted) {
+					m_stats.predicted++;
+					for (int i = 0; i < m_lastPredicted; ++i)
+						if (m_predicted[i] == index)
+							m_stats.hits++;
+				}
+
+				if (m_prev >= 0 && m_prev != index)
+					learn(m_prev, index);
+				m_prev = index;
+
+				count = predict(index, predicted);
+				std::copy(predicted, predicted + count, m_predicted);
+				m_lastPredicted = count;
+			}
+
+			if constexpr (pak_readahead_source<Source>) {
+				for (int i = 0; i < count; ++i) {
+					auto& f = m_archive.files()[predicted[i]];
+					uint64_t len = f.size < m_maxBytes ? f.size : m_maxBytes;
+					if (!len)
+						continue;
+					m_archive.source().readahead(f.offset, len);
+					std::lock_guard lock(m_lock);
+					m_stats.issued++;
+					m_stats.issued_bytes += len;
+				}
+			}
+		}
+
+		/**
+		 * \brief Learn from a trace of entry names, one per line, in the order they were read
+		 */
+		bool learn_trace(const char* path) {
+			FILE* fp = fopen(path, "rb");
+			if (!fp)
+				return false;
+
+			std::lock_guard lock(m_lock);
+			char line[MAX_PAK_NAME_LEN + 8];
+			int prev = -1;
+			while (fgets(line, sizeof(line), fp)) {
+				line[strcspn(line, "\r\n")] = 0;
+				int index = m_archive.find(line);
+				if (index < 0)
+					continue;
+				if (prev >= 0 && prev != index)
+					learn(prev, index);
+				prev = index;
+			}
+			fclose(fp);
+			return true;
+		}
+
+		/**
+		 * \brief Save the learned successors, as lines of "count<TAB>entry<TAB>successor"
+		 */
+		bool save(const char* path) const {
+			FILE* fp = fopen(path, "wb");
+			if (!fp)
+				return false;
+
+			std::lock_guard lock(m_lock);
+			for (auto& row : m_rows) {
+				if (row.entry < 0)
+					continue;
+				auto from = m_archive.name(row.entry);
+				for (int w = 0; w < PAK_PREFETCH_WAYS; ++w) {
+					if (!row.count[w])
+						continue;
+					auto to = m_archive.name(row.next[w]);
+					fprintf(fp, "%u\t%.*s\t%.*s\n", row.count[w], int(from.size()), from.data(), int(to.size()), to.data());
+				}
+			}
+			return fclose(fp) == 0;
+		}
+
+		/**
+		 * \brief Load successors written by save(), adding to what has been learned so far
+		 */
+		bool load(const char* path) {
+			FILE* fp = fopen(path, "rb");
+			if (!fp)
+				return false;
+
+			std::lock_guard lock(m_lock);
+			char line[2 * MAX_PAK_NAME_LEN + 32];
+			while (fgets(line, sizeof(line), fp)) {
+				line[strcspn(line, "\r\n")] = 0;
+				char* from = strchr(line, '\t');
+				char* to = from ? strchr(from + 1, '\t') : nullptr;
+				if (!to)
+					continue;
+				*from++ = 0;
+				*to++ = 0;
+				int a = m_archive.find(from), b = m_archive.find(to);
+				if (a >= 0 && b >= 0 && a != b)
+					learn(a, b, strtoul(line, nullptr, 10));
+			}
+			fclose(fp);
+			return true;
+		}
+
+	protected:
+		struct row_t {
+			int entry = -1;
+			int next[PAK_PREFETCH_WAYS] {};
+			uint16_t count[PAK_PREFETCH_WAYS] {};
+		};
+
+		inline row_t& row_for(int entry) {
+			return m_rows[(uint32_t(entry) * 2654435761u) & (m_rows.size() - 1)];
+		}
+
+		void learn(int from, int to, unsigned weight = 1) {
+			auto& row = row_for(from);
+			if (row.entry != from) {
+				/* Another entry owns the slot, age it out before taking over */
+				bool empty = true;
+				for (auto& c : row.count) {
+					c >>= 1;
+					empty = empty && !c;
+				}
+				if (!empty)
+					return;
+				row = row_t{};
+				row.entry = from;
+			}
+
+			/* Bump the successor, or replace the weakest one */
+			int way = 0;
+			for (int w = 0; w < PAK_PREFETCH_WAYS; ++w) {
+				if (row.count[w] && row.next[w] == to) {
+					way = w;
+					break;
+				}
+				if (row.count[w] < row.count[way])
+					way = w;
+			}
+			if (!row.count[way] || row.next[way] != to) {
+				row.next[way] = to;
+				row.count[way] = 0;
+			}
+
+			if (row.count[way] + weight > UINT16_MAX) {
+				/* Halve everything so counts stay relative */
+				for (auto& c : row.count)
+					c >>= 1;
+			}
+			row.count[way] = row.count[way] + weight > UINT16_MAX ? UINT16_MAX : row.count[way] + weight;
+		}
+
+		/* Likeliest successors of entry, most likely first. Successors seen only once are not trusted */
+		int predict(int entry, int* out) {
+			auto& row = row_for(entry);
+			if (row.entry != entry)
+				return 0;
+
+			int ways[PAK_PREFETCH_WAYS] = {0, 1, 2, 3};
+			std::sort(ways, ways + PAK_PREFETCH_WAYS, [&](int a, int b) { return row.count[a] > row.count[b]; });
+			int n = 0;
+			for (int i = 0; i < m_fanout && row.count[ways[i]] >= 2; ++i)
+				if (row.next[ways[i]] < m_archive.file_count())
+					out[n++] = row.next[ways[i]];
+			return n;
+		}
+
+		const basic_pak_archive<Source>& m_archive;
+		const int m_fanout;
+		const uint64_t m_maxBytes;
+
+		mutable std::mutex m_lock;
+		std::vector<row_t> m_rows;
+		stats_t m_stats;
+		int m_prev = -1;
+		int m_predicted[PAK_PREFETCH_WAYS] {};
+		int m_lastPredicted = 0;
+	};
+}
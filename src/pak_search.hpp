@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace paklib
+{
+	/**
+	 * \brief Finds a fixed byte string in buffers
+	 * With SSE2, 16 candidate positions are tested at once by comparing the first and last byte
+	 * of the needle, and only positions where both match are compared in full. Elsewhere, and for
+	 * the tail of a buffer, the first byte is located with memchr.
+	 */
+	class pak_substring_search {
+	public:
+		explicit pak_substring_search(std::string_view needle) : m_needle(needle) {}
+
+		inline size_t size() const { return m_needle.size(); }
+
+		/**
+		 * \brief First match starting in [begin, end) and ending before end, or nullptr
+		 */
+		const uint8_t* find(const uint8_t* begin, const uint8_t* end) const {
+			const size_t n = m_needle.size();
+			if (n == 0 || size_t(end - begin) < n)
+				return nullptr;
+			auto* needle = reinterpret_cast<const uint8_t*>(m_needle.data());
+			const uint8_t* last = end - n;	/* Last position a match can start at */
+			const uint8_t* p = begin;
+
+#if defined(__SSE2__)
+			if (n >= 2) {
+				const __m128i first = _mm_set1_epi8(char(needle[0]));
+				const __m128i final = _mm_set1_epi8(char(needle[n - 1]));
+				for (; p + 16 <= last + 1; p += 16) {
+					__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+					__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n - 1));
+					unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, final)));
+					while (mask) {
+						int bit = __builtin_ctz(mask);
+						if (std::memcmp(p + bit + 1, needle + 1, n - 2) == 0)
+							return p + bit;
+						mask &= mask - 1;
+					}
+				}
+			}
+#endif
+
+			while (p <= last) {
+				p = static_cast<const uint8_t*>(std::memchr(p, needle[0], last - p + 1));
+				if (!p)
+					return nullptr;
+				if (std::memcmp(p + 1, needle + 1, n - 1) == 0)
+					return p;
+				++p;
+			}
+			return nullptr;
+		}
+
+	protected:
+		std::string m_needle;
+	};
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <concepts>
+#include <utility>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace paklib
+{
+	/**
+	 * \brief Anything pak_archive can read bytes from
+	 * read() copies len bytes starting at off into dst, and fails if the range is out of bounds.
+	 */
+	template<class T>
+	concept pak_byte_source = requires(const T& src, void* dst, size_t len, uint64_t off) {
+		{ src.size() } -> std::convertible_to<uint64_t>;
+		{ src.read(dst, len, off) } -> std::same_as<bool>;
+	};
+
+	/**
+	 * \brief Byte source whose entire contents are addressable in memory
+	 * Archives over these sources use the directory in place and can hand out views of entries.
+	 */
+	template<class T>
+	concept pak_contiguous_source = pak_byte_source<T> && requires(const T& src) {
+		{ src.data() } -> std::same_as<const uint8_t*>;
+	};
+
+	/**
+	 * \brief Byte source that can be opened from a path on disk
+	 */
+	template<class T>
+	concept pak_path_source = pak_byte_source<T> && requires(T& src, const char* path) {
+		{ src.open(path) } -> std::same_as<bool>;
+	};
+
+	/**
+	 * \brief Byte source that can start loading a range in the background ahead of a read
+	 */
+	template<class T>
+	concept pak_readahead_source = pak_byte_source<T> && requires(const T& src, uint64_t off, uint64_t len) {
+		src.readahead(off, len);
+	};
+
+	/**
+	 * \brief Reads through a stdio FILE
+	 * Reads seek the shared FILE, so this source must not be used from multiple threads at once.
+	 */
+	class stdio_source {
+	public:
+		stdio_source() = default;
+		stdio_source(const stdio_source&) = delete;
+		stdio_source(stdio_source&& o) noexcept : m_file(std::exchange(o.m_file, nullptr)), m_size(o.m_size) {}
+		stdio_source& operator=(stdio_source&& o) noexcept {
+			std::swap(m_file, o.m_file);
+			std::swap(m_size, o.m_size);
+			return *this;
+		}
+		~stdio_source() { close(); }
+
+		bool open(const char* path) {
+			close();
+			m_file = fopen(path, "rb");
+			if (!m_file)
+				return false;
+			fseek(m_file, 0, SEEK_END);
+			m_size = ftell(m_file);
+			fseek(m_file, 0, SEEK_SET);
+			return true;
+		}
+
+		void close() {
+			if (m_file)
+				fclose(m_file);
+			m_file = nullptr;
+			m_size = 0;
+		}
+
+		inline uint64_t size() const { return m_size; }
+		inline FILE* file() const { return m_file; }
+
+		void readahead(uint64_t off, uint64_t len) const {
+			/* A length of 0 would advise everything up to the end of the file */
+			if (m_file && len)
+				posix_fadvise(fileno(m_file), off, len, POSIX_FADV_WILLNEED);
+		}
+
+		bool read(void* dst, size_t len, uint64_t off) const {
+			if (!m_file || off + len > m_size)
+				return false;
+			if (!len)
+				return true;
+			fseek(m_file, off, SEEK_SET);
+			return fread(dst, len, 1, m_file) == 1;
+		}
+
+	protected:
+		FILE* m_file = nullptr;
+		uint64_t m_size = 0;
+	};
+
+	/**
+	 * \brief Reads from a file descriptor with pread
+	 * Reads do not share a file position, so this source can be used from many threads at once.
+	 */
+	class fd_source {
+	public:
+		fd_source() = default;
+		explicit fd_source(int fd) : m_fd(fd) {
+			struct stat st;
+			if (fstat(fd, &st) == 0)
+				m_size = st.st_size;
+		}
+		fd_source(const fd_source&) = delete;
+		fd_source(fd_source&& o) noexcept : m_fd(std::exchange(o.m_fd, -1)), m_size(o.m_size) {}
+		fd_source& operator=(fd_source&& o) noexcept {
+			std::swap(m_fd, o.m_fd);
+			std::swap(m_size, o.m_size);
+			return *this;
+		}
+		~fd_source() { close(); }
+
+		bool open(const char* path) {
+			close();
+			m_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+			if (m_fd < 0)
+				return false;
+			struct stat st;
+			if (fstat(m_fd, &st) != 0) {
+				close();
+				return false;
+			}
+			m_size = st.st_size;
+			return true;
+		}
+
+		void close() {
+			if (m_fd >= 0)
+				::close(m_fd);
+			m_fd = -1;
+			m_size = 0;
+		}
+
+		inline uint64_t size() const { return m_size; }
+		inline int fd() const { return m_fd; }
+
+		/**
+		 * \brief Have the kernel start reading the range into the page cache
+		 */
+		void readahead(uint64_t off, uint64_t len) const {
+			/* A length of 0 would advise everything up to the end of the file */
+			if (m_fd >= 0 && len)
+				posix_fadvise(m_fd, off, len, POSIX_FADV_WILLNEED);
+		}
+
+		bool read(void* dst, size_t len, uint64_t off) const {
+			if (m_fd < 0 || off + len > m_size)
+				return false;
+			auto* p = static_cast<char*>(dst);
+			while (len > 0) {
+				ssize_t r = pread(m_fd, p, len, off);
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r <= 0)
+					return false;
+				p += r;
+				off += r;
+				len -= r;
+			}
+			return true;
+		}
+
+	protected:
+		int m_fd = -1;
+		uint64_t m_size = 0;
+	};
+
+	/* Size of a PMD huge page, which both transparent huge pages and hugetlbfs default to */
+	constexpr uint64_t PAK_HUGE_PAGE_SIZE = 2 << 20;
+
+	/**
+	 * \brief How mmap_source asks for huge pages
+	 */
+	enum class pak_huge_pages {
+		none,
+		advise,	/* Map the file 2 MiB aligned and madvise(MADV_HUGEPAGE). Needs kernel support for file THP */
+		copy,	/* Copy the file into anonymous huge pages, from hugetlbfs if any are reserved, else THP */
+	};
+
+	/**
+	 * \brief Maps the whole file into memory
+	 * The descriptor is kept open alongside the mapping for callers that want to pass it to the kernel.
+	 * Archives of at least PAK_HUGE_PAGE_SIZE can ask for huge pages to cut TLB misses on random
+	 * access, huge_page_bytes() reports how much of the mapping the kernel actually backed with them.
+	 */
+	class mmap_source {
+	public:
+		mmap_source() = default;
+		mmap_source(const mmap_source&) = delete;
+		mmap_source(mmap_source&& o) noexcept
+			: m_fd(std::exchange(o.m_fd, -1)), m_data(std::exchange(o.m_data, nullptr)), m_size(std::exchange(o.m_size, 0)),
+			m_mapSize(std::exchange(o.m_mapSize, 0)), m_huge(std::exchange(o.m_huge, pak_huge_pages::none)) {}
+		mmap_source& operator=(mmap_source&& o) noexcept {
+			std::swap(m_fd, o.m_fd);
+			std::swap(m_data, o.m_data);
+			std::swap(m_size, o.m_size);
+			std::swap(m_mapSize, o.m_mapSize);
+			std::swap(m_huge, o.m_huge);
+			return *this;
+		}
+		~mmap_source() { close(); }
+
+		bool open(const char* path, pak_huge_pages huge = pak_huge_pages::none) {
+			close();
+			m_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+			if (m_fd < 0)
+				return false;
+			struct stat st;
+			if (fstat(m_fd, &st) != 0) {
+				close();
+				return false;
+			}
+			m_size = st.st_size;
+
+			/* Can't map an empty file, but an empty source is still valid */
+			if (!m_size)
+				return true;
+			if (m_size < PAK_HUGE_PAGE_SIZE)
+				huge = pak_huge_pages::none;
+
+			bool ok;
+			switch (huge) {
+			case pak_huge_pages::advise: ok = map_aligned(); break;
+			case pak_huge_pages::copy: ok = map_copy(); break;
+			default: ok = map(nullptr, m_size, 0); break;
+			}
+			if (!ok) {
+				close();
+				return false;
+			}
+			m_huge = huge;
+			return true;
+		}
+
+		void close() {
+			if (m_data)
+				munmap(const_cast<uint8_t*>(m_data), m_mapSize);
+			if (m_fd >= 0)
+				::close(m_fd);
+			m_data = nullptr;
+			m_fd = -1;
+			m_size = 0;
+			m_mapSize = 0;
+			m_huge = pak_huge_pages::none;
+		}
+
+		/**
+		 * \brief Huge page mode in effect, none if the file was too small for it
+		 */
+		inline pak_huge_pages huge_pages() const { return m_huge; }
+
+		/**
+		 * \brief Bytes of the mapping currently backed by huge pages, from /proc/self/smaps
+		 * Transparent huge pages are assembled as the mapping is touched (or later, by
+		 * khugepaged), so this grows as the archive is read.
+		 */
+		uint64_t huge_page_bytes() const {
+			if (!m_data)
+				return 0;
+			FILE* fp = fopen("/proc/self/smaps", "rb");
+			if (!fp)
+				return 0;
+			const uintptr_t base = reinterpret_cast<uintptr_t>(m_data);
+			uint64_t bytes = 0;
+			bool inside = false;
+			char line[256];
+			while (fgets(line, sizeof(line), fp)) {
+				unsigned long lo, hi, kb;
+				char key[64];
+				if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2 && strchr(line, '-') < strchr(line, ' '))
+					inside = lo >= base && hi <= base + m_mapSize;
+				else if (inside && sscanf(line, "%63[^:]: %lu kB", key, &kb) == 2
+					&& (!strcmp(key, "AnonHugePages") || !strcmp(key, "FilePmdMapped")
+						|| !strcmp(key, "Private_Hugetlb") || !strcmp(key, "Shared_Hugetlb")))
+					bytes += uint64_t(kb) * 1024;
+			}
+			fclose(fp);
+			return bytes;
+		}
+
+		inline uint64_t size() const { return m_size; }
+		inline const uint8_t* data() const { return m_data; }
+		inline int fd() const { return m_fd; }
+
+		/**
+		 * \brief Have the kernel start faulting the range in
+		 */
+		void readahead(uint64_t off, uint64_t len) const {
+			if (!m_data || off >= m_size || !len)
+				return;
+			if (len > m_size - off)
+				len = m_size - off;
+			/* madvise wants a page aligned start */
+			const uint64_t page = sysconf(_SC_PAGESIZE);
+			uint64_t start = off & ~(page - 1);
+			madvise(const_cast<uint8_t*>(m_data) + start, len + (off - start), MADV_WILLNEED);
+		}
+
+		inline bool read(void* dst, size_t len, uint64_t off) const {
+			if (off + len > m_size)
+				return false;
+			if (len)
+				std::memcpy(dst, m_data + off, len);
+			return true;
+		}
+
+	protected:
+		bool map(void* addr, uint64_t len, int flags) {
+			void* p = mmap(addr, len, PROT_READ, MAP_SHARED | flags, m_fd, 0);
+			if (p == MAP_FAILED)
+				return false;
+			m_data = static_cast<const uint8_t*>(p);
+			m_mapSize = len;
+			return true;
+		}
+
+		/* Reserve address space so the file can be mapped at a huge page boundary */
+		static uint8_t* reserve_aligned(uint64_t len) {
+			const uint64_t span = len + PAK_HUGE_PAGE_SIZE;
+			void* p = mmap(nullptr, span, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			if (p == MAP_FAILED)
+				return nullptr;
+			auto* raw = static_cast<uint8_t*>(p);
+			auto* aligned = reinterpret_cast<uint8_t*>((reinterpret_cast<uintptr_t>(raw) + PAK_HUGE_PAGE_SIZE - 1) & ~(PAK_HUGE_PAGE_SIZE - 1));
+			if (aligned > raw)
+				munmap(raw, aligned - raw);
+			munmap(aligned + len, raw + span - (aligned + len));
+			return aligned;
+		}
+
+		bool map_aligned() {
+			/* File offset 0 lands on a huge page boundary, so every aligned 2 MiB of the file can use one */
+			auto* addr = reserve_aligned(m_size);
+			if (!addr || !map(addr, m_size, MAP_FIXED))
+				return false;
+			madvise(addr, m_size, MADV_HUGEPAGE);
+			return true;
+		}
+
+		bool map_copy() {
+			const uint64_t len = (m_size + PAK_HUGE_PAGE_SIZE - 1) & ~(PAK_HUGE_PAGE_SIZE - 1);
+			void* p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p == MAP_FAILED) {
+				/* No hugetlbfs pages reserved, fall back to transparent huge pages */
+				auto* addr = reserve_aligned(len);
+				p = addr ? mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) : MAP_FAILED;
+				if (p == MAP_FAILED)
+					return false;
+				madvise(p, len, MADV_HUGEPAGE);
+			}
+			m_data = static_cast<const uint8_t*>(p);
+			m_mapSize = len;
+
+			auto* dst = static_cast<uint8_t*>(p);
+			for (uint64_t off = 0; off < m_size;) {
+				ssize_t r = pread(m_fd, dst + off, m_size - off, off);
+				if (r < 0 && errno == EINTR)
+					continue;
+				if (r <= 0)
+					return false;
+				off += r;
+			}
+			mprotect(p, len, PROT_READ);
+			return true;
+		}
+
+		int m_fd = -1;
+		const uint8_t* m_data = nullptr;
+		uint64_t m_size = 0;
+		uint64_t m_mapSize = 0;
+		pak_huge_pages m_huge = pak_huge_pages::none;
+	};
+
+	/**
+	 * \brief Serves bytes from caller-owned memory, which must outlive the source
+	 */
+	class memory_source {
+	public:
+		memory_source() = default;
+		memory_source(const void* data, size_t size) : m_data(static_cast<const uint8_t*>(data)), m_size(size) {}
+
+		inline uint64_t size() const { return m_size; }
+		inline const uint8_t* data() const { return m_data; }
+
+		inline bool read(void* dst, size_t len, uint64_t off) const {
+			if (off + len > m_size)
+				return false;
+			if (len)
+				std::memcpy(dst, m_data + off, len);
+			return true;
+		}
+
+	protected:
+		const uint8_t* m_data = nullptr;
+		uint64_t m_size = 0;
+	};
+
+	/**
+	 * \brief Window of [offset, offset + size) over another source, which must outlive this one
+	 * Offsets passed to read() are relative to the start of the window.
+	 */
+	template<pak_byte_source Parent>
+	class subrange_source {
+	public:
+		subrange_source() = default;
+		subrange_source(const Parent& parent, uint64_t offset, uint64_t size)
+			: m_parent(&parent), m_offset(offset), m_size(size) {
+			/* Clamp windows that run off the end of the parent */
+			if (m_offset > parent.size())
+				m_offset = parent.size();
+			if (m_size > parent.size() - m_offset)
+				m_size = parent.size() - m_offset;
+		}
+
+		inline uint64_t size() const { return m_size; }
+		inline uint64_t offset() const { return m_offset; }
+		inline const Parent& parent() const { return *m_parent; }
+
+		inline const uint8_t* data() const requires pak_contiguous_source<Parent> {
+			return m_parent ? m_parent->data() + m_offset : nullptr;
+		}
+
+		void readahead(uint64_t off, uint64_t len) const requires pak_readahead_source<Parent> {
+			if (!m_parent || off >= m_size || !len)
+				return;
+			m_parent->readahead(m_offset + off, len < m_size - off ? len : m_size - off);
+		}
+
+		inline bool read(void* dst, size_t len, uint64_t off) const {
+			if (!m_parent || off + len > m_size)
+				return false;
+			return m_parent->read(dst, len, m_offset + off);
+		}
+
+	protected:
+		const Parent* m_parent = nullptr;
+		uint64_t m_offset = 0;
+		uint64_t m_size = 0;
+	};
+}
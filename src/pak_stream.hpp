@@ -0,0 +1,135 @@
+#pragma once
+
+#include <istream>
+#include <streambuf>
+#include <vector>
+
+#include "pak.hpp"
+
+namespace paklib
+{
+	/* Default size of the read buffer for entries of archives that are not in memory */
+	constexpr size_t PAK_STREAM_BUFFER_SIZE = 64 * 1024;
+
+	/**
+	 * \brief Read-only, seekable streambuf over a single entry of an archive
+	 * Entries of archives over contiguous sources are served straight out of memory. Otherwise
+	 * the entry is read in pieces of buffer_size bytes, and reads larger than the buffer go
+	 * directly into the caller's memory. The archive must outlive the streambuf.
+	 */
+	template<pak_byte_source Source>
+	class pak_entry_streambuf : public std::streambuf {
+	public:
+		pak_entry_streambuf(const basic_pak_archive<Source>& archive, int index, size_t buffer_size = PAK_STREAM_BUFFER_SIZE)
+			: m_archive(archive), m_index(index) {
+			if (index < 0 || index >= archive.file_count())
+				return;
+			m_size = archive.files()[index].size;
+
+			if constexpr (pak_contiguous_source<Source>) {
+				auto v = archive.view(index);
+				auto* p = const_cast<char*>(reinterpret_cast<const char*>(v.data()));
+				setg(p, p, p + v.size());
+				m_size = v.size();
+			}
+			else {
+				m_buffer.resize(buffer_size ? buffer_size : 1);
+			}
+		}
+
+		inline bool valid() const { return m_index >= 0 && m_index < m_archive.file_count(); }
+		inline uint64_t size() const { return m_size; }
+
+	protected:
+		/* Offset within the entry of the current read position */
+		inline uint64_t position() const { return m_base + (gptr() - eback()); }
+
+		int_type underflow() override {
+			if constexpr (!pak_contiguous_source<Source>) {
+				if (gptr() == egptr()) {
+					uint64_t pos = position();
+					size_t n = m_archive.read_range(m_index, pos, m_buffer.data(), m_buffer.size());
+					m_base = pos;
+					setg(m_buffer.data(), m_buffer.data(), m_buffer.data() + n);
+				}
+			}
+			return gptr() == egptr() ? traits_type::eof() : traits_type::to_int_type(*gptr());
+		}
+
+		std::streamsize xsgetn(char* s, std::streamsize count) override {
+			if constexpr (!pak_contiguous_source<Source>) {
+				/* Drain the buffer, then read large requests around it */
+				std::streamsize avail = egptr() - gptr();
+				if (count > avail && count - avail >= std::streamsize(m_buffer.size())) {
+					std::memcpy(s, gptr(), avail);
+					uint64_t pos = position() + avail;
+					size_t n = m_archive.read_range(m_index, pos, s + avail, count - avail);
+					m_base = pos + n;
+					setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+					return avail + n;
+				}
+			}
+			return std::streambuf::xsgetn(s, count);
+		}
+
+		std::streamsize showmanyc() override {
+			uint64_t pos = position();
+			return pos < m_size ? std::streamsize(m_size - pos) : -1;
+		}
+
+		pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+			if (!(which & std::ios_base::in))
+				return pos_type(off_type(-1));
+			off_type base = dir == std::ios_base::beg ? 0 : dir == std::ios_base::cur ? off_type(position()) : off_type(m_size);
+			return seekpos(pos_type(base + off), which);
+		}
+
+		pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+			off_type p = pos;
+			if (!(which & std::ios_base::in) || p < 0 || uint64_t(p) > m_size)
+				return pos_type(off_type(-1));
+
+			if constexpr (pak_contiguous_source<Source>) {
+				setg(eback(), eback() + p, egptr());
+			}
+			else {
+				/* Stay in the buffer if we can, otherwise drop it and refill on the next read */
+				if (uint64_t(p) >= m_base && uint64_t(p) <= m_base + (egptr() - eback()))
+					setg(eback(), eback() + (p - m_base), egptr());
+				else {
+					m_base = p;
+					setg(m_buffer.data(), m_buffer.data(), m_buffer.data());
+				}
+			}
+			return pos;
+		}
+
+		const basic_pak_archive<Source>& m_archive;
+		int m_index;
+		uint64_t m_size = 0;
+		uint64_t m_base = 0;	/* Offset within the entry of eback() */
+		std::vector<char> m_buffer;
+	};
+
+	/**
+	 * \brief std::istream over a single entry of an archive, see pak_entry_streambuf
+	 */
+	template<pak_byte_source Source>
+	class pak_entry_istream : public std::istream {
+	public:
+		pak_entry_istream(const basic_pak_archive<Source>& archive, int index, size_t buffer_size = PAK_STREAM_BUFFER_SIZE)
+			: std::istream(nullptr), m_buf(archive, index, buffer_size) {
+			rdbuf(&m_buf);
+			if (!m_buf.valid())
+				setstate(std::ios_base::failbit);
+		}
+
+		pak_entry_istream(const basic_pak_archive<Source>& archive, std::string_view pak_path, size_t buffer_size = PAK_STREAM_BUFFER_SIZE)
+			: pak_entry_istream(archive, archive.find(pak_path), buffer_size) {}
+
+		inline uint64_t size() const { return m_buf.size(); }
+
+	protected:
+		pak_entry_streambuf<Source> m_buf;
+	};
+}
@@ -0,0 +1,299 @@
+/**
+ * pakreplay -- Replays a recorded access log against a PAK file and reports throughput and latency
+ *
+ * The log has one access per line, blank lines and lines starting with # are ignored:
+ *   <timestamp in microseconds> <thread> <offset> <length> <entry name>
+ * A length of 0 reads the whole entry. Timestamps may be absolute, such as microseconds since
+ * the epoch, as the replay counts them from the earliest one in the log.
+ *
+ * --huge-pages maps the archive with huge pages on the mmap backend, and reports how much of it
+ * the kernel actually put on them.
+ */
+#include "pak.hpp"
+#include "argparse.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
+
+using replay_clock = std::chrono::steady_clock;
+
+struct access_t {
+	uint64_t timestamp;	/* Microseconds since the start of the log */
+	uint64_t offset;
+	uint64_t length;
+	std::string name;
+};
+
+struct result_t {
+	std::vector<uint64_t> latencies;	/* Nanoseconds, one per access */
+	uint64_t bytes = 0;
+	uint64_t missing = 0;
+	double seconds = 0;
+	uint64_t huge_bytes = 0;	/* Bytes of the mapping on huge pages after the run, mmap only */
+};
+
+static bool load_log(const char* path, std::map<uint64_t, std::vector<access_t>>& threads, size_t& count) {
+	FILE* fp = fopen(path, "rb");
+	if (!fp)
+		return false;
+
+	char line[512];
+	int lineno = 0;
+	uint64_t first = UINT64_MAX;
+	count = 0;
+	while (fgets(line, sizeof(line), fp)) {
+		++lineno;
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0] || line[0] == '#')
+			continue;
+
+		access_t a;
+		unsigned long long ts, tid, off, len;
+		int name_at = 0;
+		if (sscanf(line, "%llu %llu %llu %llu %n", &ts, &tid, &off, &len, &name_at) != 4 || !line[name_at]) {
+			fprintf(stderr, "%s:%d: malformed access\n", path, lineno);
+			fclose(fp);
+			return false;
+		}
+		a.timestamp = ts;
+		a.offset = off;
+		a.length = len;
+		a.name = line + name_at;
+		first = std::min<uint64_t>(first, ts);
+		threads[tid].push_back(std::move(a));
+		++count;
+	}
+	fclose(fp);
+
+	/* Make timestamps relative to the start of the log */
+	for (auto& [tid, accesses] : threads)
+		for (auto& a : accesses)
+			a.timestamp -= first;
+	return true;
+}
+
+/**
+ * \brief Replay the log against one backend
+ * Recorded threads are spread over workers, each replaying its accesses in order. With speed > 0
+ * every access waits for its recorded time divided by speed, otherwise accesses go back to back.
+ */
+template<class Source>
+static bool replay(const char* pak, const std::vector<std::vector<const access_t*>>& work, double speed,
+	std::pmr::memory_resource* mr, paklib::pak_huge_pages huge, result_t& result) {
+
+	/* stdio archives share a file position, so give each worker its own */
+	constexpr bool shared = !std::is_same_v<Source, paklib::stdio_source>;
+	std::vector<std::unique_ptr<paklib::basic_pak_archive<Source>>> archives(shared ? 1 : work.size());
+	for (auto& a : archives) {
+		a = std::make_unique<paklib::basic_pak_archive<Source>>();
+		if constexpr (std::is_same_v<Source, paklib::mmap_source>) {
+			paklib::mmap_source src;
+			if (!src.open(pak, huge) || !a->open(std::move(src)))
+				return false;
+		}
+		else if (!a->open(pak))
+			return false;
+	}
+
+	std::vector<result_t> results(work.size());
+	std::vector<std::thread> threads;
+	std::atomic<bool> go {false};
+	replay_clock::time_point start;
+
+	for (size_t w = 0; w < work.size(); ++w) {
+		threads.emplace_back([&, w] {
+			auto& archive = *archives[shared ? 0 : w];
+			auto& r = results[w];
+			r.latencies.reserve(work[w].size());
+			std::vector<uint8_t> buf;
+
+			while (!go)
+				std::this_thread::yield();
+
+			for (auto* a : work[w]) {
+				if (speed > 0)
+					std::this_thread::sleep_until(start + std::chrono::nanoseconds(uint64_t(a->timestamp * 1000 / speed)));
+
+				auto t0 = replay_clock::now();
+				int index = archive.find(a->name);
+				if (index < 0) {
+					r.missing++;
+					continue;
+				}
+				if (a->length == 0) {
+					auto data = archive.read_file(index, mr);
+					r.bytes += data.size();
+				}
+				else {
+					paklib::pak_buffer data(a->length, mr);
+					r.bytes += archive.read_range(index, a->offset, data.data(), a->length);
+				}
+				auto t1 = replay_clock::now();
+				r.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count());
+			}
+		});
+	}
+
+	start = replay_clock::now();
+	go = true;
+	for (auto& t : threads)
+		t.join();
+	result.seconds = std::chrono::duration<double>(replay_clock::now() - start).count();
+
+	for (auto& r : results) {
+		result.latencies.insert(result.latencies.end(), r.latencies.begin(), r.latencies.end());
+		result.bytes += r.bytes;
+		result.missing += r.missing;
+	}
+	std::sort(result.latencies.begin(), result.latencies.end());
+	if constexpr (std::is_same_v<Source, paklib::mmap_source>)
+		result.huge_bytes = archives[0]->source().huge_page_bytes();
+	return true;
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double p) {
+	if (sorted.empty())
+		return 0;
+	size_t i = size_t(p * (sorted.size() - 1) + 0.5);
+	return sorted[i] / 1000.0;
+}
+
+/**
+ * \brief Ask the kernel to drop the archive from the page cache, so the run starts cold
+ */
+static void drop_cache(const char* pak) {
+	int fd = open(pak, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+int main(int argc, char** argv) {
+	argparse::ArgumentParser parser("pakreplay");
+
+	parser.add_argument("pak")
+		.help("PAK file to replay against");
+	parser.add_argument("log")
+		.help("Access log to replay");
+	parser.add_argument("-b", "--backend")
+		.help("Backends to compare: stdio, fd, mmap")
+		.default_value(std::vector<std::string>{"stdio", "fd", "mmap"})
+		.append();
+	parser.add_argument("-t", "--threads")
+		.help("Number of replay threads. 0 replays each recorded thread on its own thread")
+		.default_value(0)
+		.scan<'i', int>();
+	parser.add_argument("-s", "--speed")
+		.help("Time scale, 2 replays twice as fast as recorded. 0 issues accesses back to back")
+		.default_value(0.0)
+		.scan<'g', double>();
+	parser.add_argument("--buffers")
+		.help("Where read buffers come from: pool (pak_buffer_pool) or heap")
+		.default_value(std::string("pool"));
+	parser.add_argument("--huge-pages")
+		.help("Huge pages for the mmap backend: none, advise (MADV_HUGEPAGE) or copy (anonymous huge page copy)")
+		.default_value(std::string("none"));
+	parser.add_argument("--cold")
+		.help("Drop the archive from the page cache before each run")
+		.default_value(false)
+		.implicit_value(true);
+
+	try {
+		parser.parse_args(argc, argv);
+	}
+	catch (const std::exception& e) {
+		fprintf(stderr, "%s\n", e.what());
+		parser.print_help();
+		exit(1);
+	}
+
+	auto pak = parser.get("pak");
+	auto log = parser.get("log");
+	const int nthreads = parser.get<int>("-t");
+	const double speed = parser.get<double>("-s");
+	const bool cold = parser.get<bool>("--cold");
+
+	auto bufs = parser.get("--buffers");
+	std::pmr::memory_resource* mr = paklib::pak_buffer_pool();
+	if (bufs == "heap")
+		mr = std::pmr::new_delete_resource();
+	else if (bufs != "pool") {
+		fprintf(stderr, "Unknown buffer source '%s'\n", bufs.c_str());
+		exit(1);
+	}
+
+	auto hp = parser.get("--huge-pages");
+	paklib::pak_huge_pages huge;
+	if (hp == "none")
+		huge = paklib::pak_huge_pages::none;
+	else if (hp == "advise")
+		huge = paklib::pak_huge_pages::advise;
+	else if (hp == "copy")
+		huge = paklib::pak_huge_pages::copy;
+	else {
+		fprintf(stderr, "Unknown huge page mode '%s'\n", hp.c_str());
+		exit(1);
+	}
+
+	std::map<uint64_t, std::vector<access_t>> recorded;
+	size_t count;
+	if (!load_log(log.c_str(), recorded, count)) {
+		fprintf(stderr, "Unable to load access log %s\n", log.c_str());
+		exit(1);
+	}
+
+	/* Spread recorded threads over the replay threads */
+	size_t workers = nthreads > 0 ? nthreads : std::max<size_t>(recorded.size(), 1);
+	std::vector<std::vector<const access_t*>> work(workers);
+	size_t n = 0;
+	for (auto& [tid, accesses] : recorded) {
+		auto& w = work[n++ % workers];
+		for (auto& a : accesses)
+			w.push_back(&a);
+	}
+	for (auto& w : work)
+		std::stable_sort(w.begin(), w.end(), [](auto* a, auto* b) { return a->timestamp < b->timestamp; });
+
+	printf("%zu accesses from %zu threads on %zu replay threads, %s buffers\n", count, recorded.size(), workers, bufs.c_str());
+	printf("%-8s %10s %12s %10s %10s %10s %10s %10s %8s\n",
+		"backend", "ops", "bytes", "seconds", "MiB/s", "p50 us", "p99 us", "p999 us", "missing");
+
+	int status = 0;
+	for (auto& backend : parser.get<std::vector<std::string>>("-b")) {
+		if (cold)
+			drop_cache(pak.c_str());
+
+		result_t r;
+		bool ok;
+		if (backend == "stdio")
+			ok = replay<paklib::stdio_source>(pak.c_str(), work, speed, mr, huge, r);
+		else if (backend == "fd")
+			ok = replay<paklib::fd_source>(pak.c_str(), work, speed, mr, huge, r);
+		else if (backend == "mmap")
+			ok = replay<paklib::mmap_source>(pak.c_str(), work, speed, mr, huge, r);
+		else {
+			fprintf(stderr, "Unknown backend '%s'\n", backend.c_str());
+			status = 1;
+			continue;
+		}
+
+		if (!ok) {
+			fprintf(stderr, "Unable to open archive %s\n", pak.c_str());
+			exit(1);
+		}
+
+		printf("%-8s %10zu %12llu %10.3f %10.1f %10.1f %10.1f %10.1f %8llu\n", backend.c_str(),
+			r.latencies.size(), (unsigned long long)r.bytes, r.seconds,
+			r.seconds > 0 ? r.bytes / r.seconds / (1024 * 1024) : 0.0,
+			percentile(r.latencies, 0.50), percentile(r.latencies, 0.99), percentile(r.latencies, 0.999),
+			(unsigned long long)r.missing);
+		if (backend == "mmap" && huge != paklib::pak_huge_pages::none)
+			printf("%-8s %s: %llu bytes on huge pages\n", "", hp.c_str(), (unsigned long long)r.huge_bytes);
+	}
+	return status;
+}
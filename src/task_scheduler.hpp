@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace paklib
+{
+	/**
+	 * \brief Work-stealing pool of worker threads
+	 * Each worker has its own deque. Workers run their own newest task first, and when they run
+	 * dry they steal the oldest task of another worker. Tasks submitted from inside a task go to
+	 * the submitting worker's deque, so a task can split itself up and let idle workers take parts.
+	 * Tasks submitted from other threads go to a shared queue that workers take from in
+	 * submission order, after their own deque and before stealing.
+	 */
+	class task_scheduler {
+	public:
+		using task_t = std::function<void()>;
+
+		explicit task_scheduler(unsigned threads = std::thread::hardware_concurrency()) {
+			if (threads == 0)
+				threads = 1;
+			for (unsigned i = 0; i < threads; ++i)
+				m_queues.push_back(std::make_unique<worker_queue_t>());
+			for (unsigned i = 0; i < threads; ++i)
+				m_threads.emplace_back([this, i] { run(i); });
+		}
+
+		task_scheduler(const task_scheduler&) = delete;
+		task_scheduler(task_scheduler&&) = delete;
+
+		~task_scheduler() {
+			wait();
+			{
+				std::lock_guard lock(m_lock);
+				m_stop = true;
+			}
+			m_wake.notify_all();
+			for (auto& t : m_threads)
+				t.join();
+		}
+
+		inline unsigned thread_count() const { return m_threads.size(); }
+
+		/**
+		 * \brief Queue a task
+		 * From a worker thread, the task goes on that worker's own deque. Otherwise it goes on
+		 * the shared queue, and tasks submitted that way start in the order they were submitted.
+		 */
+		void submit(task_t task) {
+			auto& q = (t_owner == this) ? *m_queues[t_index] : m_injected;
+			m_pending++;
+
+			/* Count it before it becomes visible, so a worker can never take it before it is counted */
+			{
+				std::lock_guard lock(m_lock);
+				m_queued++;
+			}
+			{
+				std::lock_guard lock(q.lock);
+				q.tasks.push_back(std::move(task));
+			}
+			m_wake.notify_one();
+		}
+
+		/**
+		 * \brief Block until every submitted task, including tasks they submitted, has finished
+		 * Must not be called from inside a task.
+		 */
+		void wait() {
+			std::unique_lock lock(m_lock);
+			m_idle.wait(lock, [this] { return m_pending == 0; });
+		}
+
+	protected:
+		struct worker_queue_t {
+			std::mutex lock;
+			std::deque<task_t> tasks;
+		};
+
+		bool pop(unsigned self, task_t& out) {
+			auto& q = *m_queues[self];
+			std::lock_guard lock(q.lock);
+			if (q.tasks.empty())
+				return false;
+			out = std::move(q.tasks.back());
+			q.tasks.pop_back();
+			return true;
+		}
+
+		bool take_injected(task_t& out) {
+			std::lock_guard lock(m_injected.lock);
+			if (m_injected.tasks.empty())
+				return false;
+			out = std::move(m_injected.tasks.front());
+			m_injected.tasks.pop_front();
+			return true;
+		}
+
+		bool steal(unsigned self, task_t& out) {
+			for (unsigned i = 1; i < m_queues.size(); ++i) {
+				auto& q = *m_queues[(self + i) % m_queues.size()];
+				std::lock_guard lock(q.lock);
+				if (q.tasks.empty())
+					continue;
+				out = std::move(q.tasks.front());
+				q.tasks.pop_front();
+				return true;
+			}
+			return false;
+		}
+
+		void run(unsigned self) {
+			t_owner = this;
+			t_index = self;
+
+			task_t task;
+			for (;;) {
+				if (pop(self, task) || take_injected(task) || steal(self, task)) {
+					{
+						std::lock_guard lock(m_lock);
+						m_queued--;
+					}
+					task();
+					task = nullptr;
+
+					if (--m_pending == 0) {
+						std::lock_guard lock(m_lock);
+						m_idle.notify_all();
+					}
+					continue;
+				}
+
+				/* Nothing to run or steal, sleep until something is queued */
+				std::unique_lock lock(m_lock);
+				m_wake.wait(lock, [this] { return m_queued > 0 || m_stop; });
+				if (m_stop && m_queued == 0)
+					return;
+			}
+		}
+
+		std::vector<std::unique_ptr<worker_queue_t>> m_queues;
+		worker_queue_t m_injected;			/* Tasks submitted from outside the workers, taken FIFO */
+		std::vector<std::thread> m_threads;
+		std::atomic<size_t> m_pending {0};	/* Submitted but not yet finished */
+
+		std::mutex m_lock;
+		size_t m_queued = 0;				/* Sitting in a deque, guarded by m_lock */
+		bool m_stop = false;
+		std::condition_variable m_wake;
+		std::condition_variable m_idle;
+
+		static inline thread_local task_scheduler* t_owner = nullptr;
+		static inline thread_local unsigned t_index = 0;
+	};
+}